@@ -6,22 +6,26 @@
 #include "lab5fs.h"
 #include "lab5fs_super.h"
 #include "lab5fs_inode.h"
+#include "lab5fs_stats.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Sourav Chakraborty");
 
 
-static struct super_block* lab5fs_get_sb(struct file_system_type *fs_type,
-				   int flags,
-				   const char *dev_name,
-				   void *data)
+static int lab5fs_get_sb(struct file_system_type *fs_type,
+			 int flags,
+			 const char *dev_name,
+			 void *data,
+			 struct vfsmount *mnt)
 {
-	return get_sb_bdev(fs_type, flags, dev_name, data, lab5fs_fill_super);
+	return get_sb_bdev(fs_type, flags, dev_name, data, lab5fs_fill_super,
+			   mnt);
 }
 
 static void lab5fs_kill_sb(struct super_block *sb)
 {
 	printk("Unmounting lab5fs\n");
+	lab5fs_orphan_flush(sb);
 	kill_block_super(sb);
 }
 
@@ -38,9 +42,15 @@ static int __init init_lab5fs(void)
 	int r;
 
 	printk("Initializing module lab5fs\n");
+	r = lab5fs_init_inodecache();
+	if(r)
+		return r;
+	lab5fs_stats_init();
 	r = register_filesystem(&lab5fs_fs_type);
 	if(r) {
 		printk("Error registering lab5fs: %d\n", r);
+		lab5fs_stats_exit();
+		lab5fs_destroy_inodecache();
 	}
 
 	return r;
@@ -49,6 +59,8 @@ static int __init init_lab5fs(void)
 static void __exit exit_lab5fs(void)
 {
 	unregister_filesystem(&lab5fs_fs_type);
+	lab5fs_stats_exit();
+	lab5fs_destroy_inodecache();
 	printk("Cleaning up module lab5fs\n");
 }
 
@@ -4,24 +4,70 @@
 #define LAB5FS_SUPER_MAGIC 0xBADC0DE
 
 #define LAB5FS_SUPER_BLOCK_NUM 0
-#define LAB5FS_BLOCK_BITMAP_NUM 1
-#define LAB5FS_INODE_BITMAP_NUM 2
-#define LAB5FS_INODE_TABLE_NUM 3
-#define LAB5FS_ROOT_INODE_NUM 4
-#define LAB5FS_ROOT_DATA_INDEX_NUM 5
-#define LAB5FS_ROOT_DATA_FIRST_NUM 6
+#define LAB5FS_BLOCK_BITMAP_NUM 1 /*block bitmap of group 0*/
+#define LAB5FS_INODE_BITMAP_NUM 2 /*inode bitmap of group 0*/
 //set root inode number to 1. Reserve inode number 0 for null
 #define LAB5FS_ROOT_INODE 1
 
 #define LAB5FS_BLOCK_SIZE 1024
 #define LAB5FS_BITS	10
-#define LAB5FS_MAX_SIZE LAB5FS_BLOCK_SIZE*LAB5FS_BLOCK_SIZE/4
-#define LAB5FS_MAX_INODE_COUNT 1024*8
-#define LAB5FS_MAX_BLOCK_COUNT 1024*8
-#define LAB5FS_MAX_FNAME 16
-#define LAB5FS_MAX_BLOCK_INDEX 256
+#define LAB5FS_BLOCKS_PER_GROUP (LAB5FS_BLOCK_SIZE*8) /*one bitmap block per group*/
+#define LAB5FS_INODES_PER_GROUP 1024 /*one inode per 8 blocks*/
+#define LAB5FS_GDT_FIRST_NUM 3 /*group descriptor table follows group 0's bitmaps*/
+#define LAB5FS_INODE_SIZE 256 /*on-disk stride of struct lab5fs_inode*/
+#define LAB5FS_INODES_PER_BLOCK (LAB5FS_BLOCK_SIZE/LAB5FS_INODE_SIZE)
+#define LAB5FS_ITABLE_BLOCKS (LAB5FS_INODES_PER_GROUP/LAB5FS_INODES_PER_BLOCK) /*inode table blocks per group*/
+#define LAB5FS_MAX_FNAME 255
+#define LAB5FS_MAX_BLOCK_INDEX (1UL << 30) /*max number of data blocks in a file*/
+#define LAB5FS_MAX_SIZE ((unsigned long long)LAB5FS_MAX_BLOCK_INDEX << LAB5FS_BITS)
+
+#define LAB5FS_DX_MAGIC 0x4458 /*directory hash index block*/
+#define LAB5FS_DIR_LEAF_MAGIC 0x4452 /*directory entry block of variable-length records*/
+#define LAB5FS_DX_MAX_LEVELS 2 /*index levels above the directory leaves*/
+
+#define LAB5FS_INLINE_SIZE 128 /*bytes of file data or directory records kept in the inode*/
+#define LAB5FS_INLINE_DATA_FL 0x1 /*i_flags: contents live in i_inline, not in blocks*/
+#define LAB5FS_ORPHAN_FL 0x2 /*i_flags: unlinked, on the orphan list awaiting deletion*/
+
+#define LAB5FS_EXTENT_MAGIC 0x1AB5
+#define LAB5FS_INODE_EXTENTS 4 /*extent tree entries kept in the inode itself*/
+#define LAB5FS_EXTENT_MAX_DEPTH 3 /*levels of extent blocks below the inode*/
+
+#define LAB5FS_JOURNAL_MAGIC 0x4A4E4C35 /*"JNL5"*/
+#define LAB5FS_JOURNAL_BLOCKS 1024 /*log length lab5mkfs aims for*/
+#define LAB5FS_JOURNAL_MIN_BLOCKS 256 /*volumes too small for this get no journal*/
+#define LAB5FS_JOURNAL_SUPER 1 /*journal block types*/
+#define LAB5FS_JOURNAL_DESC 2
+#define LAB5FS_JOURNAL_REVOKE 3
+#define LAB5FS_JOURNAL_COMMIT 4
 
 #include <linux/types.h>
+
+/*
+ * Extent tree node header. Found at the start of every extent block and
+ * in the inode (where it is the root of the tree). eh_depth is 0 for
+ * leaves, which hold struct lab5fs_extent entries; index nodes hold
+ * struct lab5fs_extent_idx entries.
+ */
+struct lab5fs_extent_header {
+    uint16_t eh_magic;
+    uint16_t eh_count; //entries in use
+    uint16_t eh_max; //capacity of this node
+    uint16_t eh_depth; //height of this node above the leaves
+};
+
+struct lab5fs_extent { /*a run of contiguous blocks*/
+    uint32_t e_logical; //first file block covered
+    uint32_t e_physical; //first disk block
+    uint32_t e_len; //number of blocks
+};
+
+struct lab5fs_extent_idx { /*same size as an extent, so both share a node layout*/
+    uint32_t ei_logical; //first file block covered by the child
+    uint32_t ei_block; //disk block of the child node
+    uint32_t ei_unused;
+};
+
 struct lab5fs_super_block {
     uint32_t s_magic; /* sb magic number*/
     uint32_t s_inode_count;  /*total number of inodes in fs*/
@@ -30,8 +76,34 @@ struct lab5fs_super_block {
     uint32_t s_free_inodes_count; /*number of available inodes*/
     uint32_t s_block_size; /*size of each block*/
     char s_volume_name[16]; //Volume name
+    uint32_t s_blocks_per_group; /*blocks covered by each group's block bitmap*/
+    uint32_t s_inodes_per_group; /*inodes covered by each group's inode bitmap*/
+    uint32_t s_groups_count; /*number of block groups*/
+    uint32_t s_gdt_blocks; /*length of the group descriptor table*/
+    uint32_t s_inode_size; /*bytes per inode table slot*/
+    uint32_t s_last_orphan; /*first inode on the list of unfinished deletions*/
+    uint32_t s_journal_block; /*first block of the journal*/
+    uint32_t s_journal_blocks; /*length of the journal, 0 if there is none*/
+};
+
+/*
+ * One entry of the group descriptor table, which starts at block
+ * LAB5FS_GDT_FIRST_NUM. Group g covers blocks g*LAB5FS_BLOCKS_PER_GROUP on
+ * and inode numbers g*LAB5FS_INODES_PER_GROUP on. Inode n of a group lives
+ * in slot n % LAB5FS_INODES_PER_BLOCK of block
+ * bg_inode_table + n / LAB5FS_INODES_PER_BLOCK.
+ */
+struct lab5fs_group_desc {
+    uint32_t bg_block_bitmap; //block number of this group's block bitmap
+    uint32_t bg_inode_bitmap; //block number of this group's inode bitmap
+    uint32_t bg_free_blocks_count;
+    uint32_t bg_free_inodes_count;
+    uint32_t bg_inode_table; //first of LAB5FS_ITABLE_BLOCKS inode table blocks
+    uint32_t bg_reserved[3];
 };
 
+#define LAB5FS_DESC_PER_BLOCK (LAB5FS_BLOCK_SIZE / sizeof(struct lab5fs_group_desc))
+
 struct lab5fs_inode {
     uint16_t i_mode; //inode type/file access rights
     uint16_t i_uid; //owner id
@@ -42,27 +114,101 @@ struct lab5fs_inode {
     uint32_t i_ctime; //time of last inode change
     uint16_t i_link_count; //number of hard links
     uint32_t i_num_blocks; //number of blocks of data used by file
-    uint32_t i_block_num; //block number of this inode
-    uint32_t i_data_index_block_num; //block number of corresponding data index
+    struct lab5fs_extent_header i_eh; //root of the extent tree
+    struct lab5fs_extent i_extents[LAB5FS_INODE_EXTENTS]; //must directly follow i_eh
+    uint32_t i_flags; //LAB5FS_*_FL
+    uint8_t i_inline[LAB5FS_INLINE_SIZE]; //contents of small files and directories
+    uint32_t i_next_orphan; //next inode on the orphan list, 0 at the end
+    uint32_t i_size_high; //upper 32 bits of the file length
 };
 
 struct lab5fs_dir {
-    uint32_t dir_inode;
+    uint32_t dir_inode; //0 for free space
+    uint16_t dir_rec_len; //bytes from this record to the next
     uint8_t dir_name_len;
-    uint8_t dir_file_type;
-    char dir_name[LAB5FS_MAX_FNAME];
+    uint8_t dir_file_type; //LAB5FS_FT_*
+    char dir_name[0]; //dir_name_len bytes, not NUL-terminated
 };
 
-struct lab5fs_bitmap {
-    uint8_t map[1024];
+/* bytes a record with a name of the given length needs, padded to 4 */
+#define LAB5FS_DIR_REC_LEN(name_len) (((name_len) + sizeof(struct lab5fs_dir) + 3) & ~3)
+
+/* dir_file_type values; records written before it was filled in hold 0 */
+enum {
+    LAB5FS_FT_UNKNOWN,
+    LAB5FS_FT_REG_FILE,
+    LAB5FS_FT_DIR,
+    LAB5FS_FT_CHRDEV,
+    LAB5FS_FT_BLKDEV,
+    LAB5FS_FT_FIFO,
+    LAB5FS_FT_SOCK,
+    LAB5FS_FT_SYMLINK,
+    LAB5FS_FT_MAX
+};
+
+/*
+ * Every directory block starts with this header. Logical block 0 of a
+ * directory is the root of its hash index; dh_levels counts the index
+ * levels from a node down to the leaves. The rest of a leaf is a chain of
+ * struct lab5fs_dir records whose dir_rec_len add up to dh_limit; a
+ * record's slack past its name is free space, and a deleted record's
+ * space is merged into the record before it (the first record of a leaf
+ * is marked free with dir_inode == 0 instead). A small directory is a
+ * single leaf kept in i_inline instead.
+ */
+struct lab5fs_dir_head {
+    uint16_t dh_magic;
+    uint16_t dh_count; //entries in use
+    uint16_t dh_limit; //index entries, or bytes of records in a leaf
+    uint16_t dh_levels; //index levels at and below this block, 0 for leaves
+};
+
+struct lab5fs_dx_entry {
+    uint32_t de_hash; //lowest name hash stored under this child
+    uint32_t de_block; //logical block of the child within the directory
+};
+
+#define LAB5FS_DIR_SPACE (LAB5FS_BLOCK_SIZE - sizeof(struct lab5fs_dir_head))
+#define LAB5FS_INLINE_DIR_SPACE (LAB5FS_INLINE_SIZE - sizeof(struct lab5fs_dir_head))
+#define LAB5FS_DIR_MAX_RECS (LAB5FS_DIR_SPACE / LAB5FS_DIR_REC_LEN(1)) //records a leaf can hold
+#define LAB5FS_DX_LIMIT ((LAB5FS_BLOCK_SIZE - sizeof(struct lab5fs_dir_head)) / sizeof(struct lab5fs_dx_entry))
+
+/*
+ * The metadata journal is a circular log of s_journal_blocks blocks. Its
+ * first block holds struct lab5fs_journal_super; the rest hold
+ * transactions. A transaction is a run of revoke and descriptor blocks,
+ * each descriptor followed by copies of the blocks it lists, and ends
+ * with a commit block whose checksum covers everything before it. Every
+ * block of a transaction carries its sequence number.
+ */
+struct lab5fs_journal_header {
+    uint32_t jh_magic;
+    uint32_t jh_type; //LAB5FS_JOURNAL_*
+    uint32_t jh_sequence; //transaction this block belongs to
+    uint32_t jh_count; //entries in jt_blocks, or logged blocks in a commit
 };
 
-struct lab5fs_inode_table {
-    uint32_t inodes[256];
+struct lab5fs_journal_super {
+    struct lab5fs_journal_header js_header;
+    uint32_t js_blocks; //length of the journal, including this block
+    uint32_t js_start; //log block of the oldest transaction still needed
+    uint32_t js_sequence; //sequence expected at js_start
 };
 
-struct lab5fs_inode_data_index { /*Data index block. Basically just an array of block numbers*/
-    uint32_t blocks[LAB5FS_MAX_BLOCK_INDEX];
+struct lab5fs_journal_tags { /*descriptor and revoke blocks*/
+    struct lab5fs_journal_header jt_header;
+    uint32_t jt_blocks[0]; //home block numbers
+};
+
+struct lab5fs_journal_commit {
+    struct lab5fs_journal_header jc_header;
+    uint32_t jc_checksum; //crc32 of the transaction's other blocks
+};
+
+#define LAB5FS_JOURNAL_TAGS ((LAB5FS_BLOCK_SIZE - sizeof(struct lab5fs_journal_header)) / sizeof(uint32_t))
+
+struct lab5fs_bitmap {
+    uint8_t map[1024];
 };
 
 
@@ -0,0 +1,942 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/errno.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include "lab5fs.h"
+#include "lab5fs_super.h"
+#include "lab5fs_inode.h"
+#include "lab5fs_extent.h"
+#include "lab5fs_dir.h"
+#include "lab5fs_stats.h"
+#include "lab5fs_journal.h"
+
+/*
+ * Directories are kept htree-style. Logical block 0 is the root of a hash
+ * index whose entries map ranges of name hashes to child blocks, sorted by
+ * hash. With one index level the children are leaves; when the root fills
+ * up its entries move into a new index block and the root indexes those
+ * blocks instead. Leaves hold variable-length struct lab5fs_dir records,
+ * ext2-style. A name is found by hashing it, walking the index to the one
+ * leaf that can hold it, and scanning that leaf. A full leaf is split in
+ * two at a hash boundary, so equal hashes never straddle leaves. Records
+ * never move within a leaf - a new one only takes free space where it
+ * lies, and a split moves half the records out to the new leaf - so a
+ * readdir position, a byte offset, never passes over a name it has not
+ * returned.
+ *
+ * A new directory has no blocks at all: its records sit in a single small
+ * leaf inside the inode (i_inline). When that leaf fills up it is moved
+ * out to a real leaf at logical block 1 under a fresh index root.
+ */
+
+#define DIR_HEAD(bh) ((struct lab5fs_dir_head *)((bh)->b_data))
+#define DIR_REC(head, off) ((struct lab5fs_dir *)((char *)((head) + 1) + (off)))
+#define DX_ENTRIES(head) ((struct lab5fs_dx_entry *)((head) + 1))
+#define INLINE_HEAD(dir) ((struct lab5fs_dir_head *)LAB5FS_INODE_INFO(dir)->i_inline)
+
+/* one index block on the way from the root to a leaf */
+struct lab5fs_dx_frame {
+	struct buffer_head *bh;
+	struct lab5fs_dir_head *head;
+	int pos;                       /* entry that was followed */
+};
+
+/* file types, indexed by the S_IFMT bits of a mode shifted down */
+#define S_SHIFT 12
+static const unsigned char lab5fs_type_by_mode[S_IFMT >> S_SHIFT] = {
+	[S_IFREG >> S_SHIFT]  = LAB5FS_FT_REG_FILE,
+	[S_IFDIR >> S_SHIFT]  = LAB5FS_FT_DIR,
+	[S_IFCHR >> S_SHIFT]  = LAB5FS_FT_CHRDEV,
+	[S_IFBLK >> S_SHIFT]  = LAB5FS_FT_BLKDEV,
+	[S_IFIFO >> S_SHIFT]  = LAB5FS_FT_FIFO,
+	[S_IFSOCK >> S_SHIFT] = LAB5FS_FT_SOCK,
+	[S_IFLNK >> S_SHIFT]  = LAB5FS_FT_SYMLINK,
+};
+
+/* what readdir reports for each file type */
+static const unsigned char lab5fs_filetype_table[LAB5FS_FT_MAX] = {
+	DT_UNKNOWN, DT_REG, DT_DIR, DT_CHR, DT_BLK, DT_FIFO, DT_SOCK, DT_LNK,
+};
+
+static inline unsigned char lab5fs_dir_dtype(struct lab5fs_dir *de)
+{
+	return de->dir_file_type < LAB5FS_FT_MAX ?
+	       lab5fs_filetype_table[de->dir_file_type] : DT_UNKNOWN;
+}
+
+/* FNV-1a hash of a file name. */
+static u32 lab5fs_dx_hash(const char *name, int len)
+{
+	u32 hash = 2166136261U;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/* Read logical block lblk of a directory. */
+static struct buffer_head *lab5fs_dir_bread(struct inode *dir,
+					    unsigned long lblk, int *err)
+{
+	struct lab5fs_inode_info *info = LAB5FS_INODE_INFO(dir);
+	struct buffer_head *bh;
+	unsigned long block_num, len;
+
+	down(&info->i_map_sem);
+	*err = lab5fs_extent_map(dir, lblk, &block_num, &len);
+	up(&info->i_map_sem);
+	if (*err)
+		return NULL;
+	if (block_num == 0) {
+		printk("directory %lu has no block %lu\n", dir->i_ino, lblk);
+		*err = -EIO;
+		return NULL;
+	}
+
+	if (!(bh = sb_bread(dir->i_sb, block_num))) {
+		printk("unable to read dir data block %lu.\n", block_num);
+		*err = -EIO;
+	}
+	return bh;
+}
+
+/*
+ * Append a new, empty block of the given kind to a directory.
+ * On success *lblk holds its logical block number.
+ */
+static struct buffer_head *lab5fs_dir_new_block(struct inode *dir, int magic,
+						unsigned long *lblk, int *err)
+{
+	struct super_block *sb = dir->i_sb;
+	struct lab5fs_inode_info *info = LAB5FS_INODE_INFO(dir);
+	struct lab5fs_dir_head *head;
+	struct buffer_head *bh;
+	int block_num;
+
+	*lblk = dir->i_size >> LAB5FS_BITS;
+
+	block_num = lab5fs_alloc_block_num(sb);
+	if (block_num == 0) {
+		*err = -ENOSPC;
+		return NULL;
+	}
+
+	down(&info->i_map_sem);
+	*err = lab5fs_extent_insert(dir, *lblk, block_num, 1);
+	up(&info->i_map_sem);
+	if (*err) {
+		lab5fs_release_block_num(sb, block_num);
+		return NULL;
+	}
+
+	if (!(bh = sb_getblk(sb, block_num))) {
+		*err = -EIO;
+		return NULL;
+	}
+	lock_buffer(bh);
+	memset(bh->b_data, 0, LAB5FS_BLOCK_SIZE);
+	head = DIR_HEAD(bh);
+	if (magic == LAB5FS_DX_MAGIC) {
+		head->dh_magic = cpu_to_le16(magic);
+		head->dh_limit = cpu_to_le16(LAB5FS_DX_LIMIT);
+	} else
+		lab5fs_dir_init_leaf(head, LAB5FS_DIR_SPACE);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	lab5fs_journal_dirty(dir->i_sb, dir, bh);
+
+	dir->i_size += LAB5FS_BLOCK_SIZE;
+	dir->i_blocks++;
+	mark_inode_dirty(dir);
+
+	*err = 0;
+	return bh;
+}
+
+static void dx_release(struct lab5fs_dx_frame *frames)
+{
+	int i;
+
+	for (i = 0; i < LAB5FS_DX_MAX_LEVELS; i++) {
+		if (frames[i].bh)
+			brelse(frames[i].bh);
+		frames[i].bh = NULL;
+	}
+}
+
+/*
+ * Walk the hash index of a directory down to the leaf responsible for hash.
+ * On success *leaf holds the leaf's logical block.
+ * @return the number of index levels, or a negative error code.
+ */
+static int dx_probe(struct inode *dir, u32 hash,
+		    struct lab5fs_dx_frame *frames, unsigned long *leaf)
+{
+	struct lab5fs_dir_head *head;
+	struct lab5fs_dx_entry *entries;
+	struct buffer_head *bh;
+	unsigned long lblk = 0;
+	int levels = 1, level, count, lo, hi, mid, err;
+
+	memset(frames, 0, sizeof(*frames) * LAB5FS_DX_MAX_LEVELS);
+
+	for (level = 0; level < levels; level++) {
+		if (!(bh = lab5fs_dir_bread(dir, lblk, &err)))
+			goto fail;
+		frames[level].bh = bh;
+		head = DIR_HEAD(bh);
+		if (level == 0)
+			levels = le16_to_cpu(head->dh_levels);
+		count = le16_to_cpu(head->dh_count);
+		if (le16_to_cpu(head->dh_magic) != LAB5FS_DX_MAGIC ||
+		    levels < 1 || levels > LAB5FS_DX_MAX_LEVELS ||
+		    le16_to_cpu(head->dh_levels) != levels - level ||
+		    count < 1) {
+			printk("bad index block %lu in directory %lu\n",
+			       lblk, dir->i_ino);
+			err = -EIO;
+			goto fail;
+		}
+
+		/* last entry whose hash is not above ours; entry 0 covers 0. */
+		entries = DX_ENTRIES(head);
+		lo = 1;
+		hi = count - 1;
+		while (lo <= hi) {
+			mid = (lo + hi) / 2;
+			if (le32_to_cpu(entries[mid].de_hash) <= hash)
+				lo = mid + 1;
+			else
+				hi = mid - 1;
+		}
+		frames[level].head = head;
+		frames[level].pos = hi;
+		lblk = le32_to_cpu(entries[hi].de_block);
+	}
+
+	*leaf = lblk;
+	return levels;
+
+  fail:
+	dx_release(frames);
+	return err;
+}
+
+/* Read the leaf for hash, checking it really is a leaf. */
+static struct buffer_head *dx_leaf(struct inode *dir, unsigned long lblk,
+				   int *err)
+{
+	struct buffer_head *bh;
+	struct lab5fs_dir_head *head;
+
+	if (!(bh = lab5fs_dir_bread(dir, lblk, err)))
+		return NULL;
+	head = DIR_HEAD(bh);
+	if (le16_to_cpu(head->dh_magic) != LAB5FS_DIR_LEAF_MAGIC ||
+	    le16_to_cpu(head->dh_limit) != LAB5FS_DIR_SPACE) {
+		printk("bad leaf block %lu in directory %lu\n", lblk, dir->i_ino);
+		brelse(bh);
+		*err = -EIO;
+		return NULL;
+	}
+	return bh;
+}
+
+/* Make head an empty leaf with space bytes for records. */
+void lab5fs_dir_init_leaf(struct lab5fs_dir_head *head, int space)
+{
+	struct lab5fs_dir *de = DIR_REC(head, 0);
+
+	head->dh_magic = cpu_to_le16(LAB5FS_DIR_LEAF_MAGIC);
+	head->dh_count = 0;
+	head->dh_limit = cpu_to_le16(space);
+	head->dh_levels = 0;
+	memset(de, 0, space);
+	de->dir_rec_len = cpu_to_le16(space);
+}
+
+/*
+ * The record at offset off of a leaf, checked to lie within the leaf and
+ * to hold its name. Walks over a leaf's records go through here.
+ * @return the record, or NULL if the leaf is corrupt.
+ */
+static struct lab5fs_dir *leaf_rec(struct inode *dir, struct lab5fs_dir_head *head,
+				   unsigned int off)
+{
+	unsigned int limit = le16_to_cpu(head->dh_limit);
+	struct lab5fs_dir *de = DIR_REC(head, off);
+	unsigned int rec_len;
+
+	if (off + LAB5FS_DIR_REC_LEN(0) > limit)
+		goto bad;
+	rec_len = le16_to_cpu(de->dir_rec_len);
+	if (rec_len < LAB5FS_DIR_REC_LEN(0) || (rec_len & 3) ||
+	    off + rec_len > limit ||
+	    (de->dir_inode && rec_len < LAB5FS_DIR_REC_LEN(de->dir_name_len)))
+		goto bad;
+	return de;
+
+  bad:
+	printk("directory %lu: bad record at offset %u\n", dir->i_ino, off);
+	return NULL;
+}
+
+/*
+ * Record holding the given name in a leaf. If prev is given it is set to
+ * the record before it, NULL for the first one.
+ * @return the record, or NULL with *err set to 0 if there is none, or to
+ * a negative error code if the leaf is corrupt.
+ */
+static struct lab5fs_dir *leaf_find(struct inode *dir, struct lab5fs_dir_head *head,
+				    const char *name, int len,
+				    struct lab5fs_dir **prev, int *err)
+{
+	unsigned int off, limit = le16_to_cpu(head->dh_limit);
+	struct lab5fs_dir *de, *last = NULL;
+
+	*err = 0;
+	for (off = 0; off < limit; off += le16_to_cpu(de->dir_rec_len)) {
+		if (!(de = leaf_rec(dir, head, off))) {
+			*err = -EIO;
+			return NULL;
+		}
+		if (de->dir_inode != 0 && de->dir_name_len == len &&
+		    memcmp(de->dir_name, name, len) == 0) {
+			if (prev)
+				*prev = last;
+			return de;
+		}
+		last = de;
+	}
+	return NULL;
+}
+
+/*
+ * Put a record for child into a leaf, in the slack of the first record
+ * with enough of it. Records already in the leaf never move: readdir
+ * positions are byte offsets, and a record moved below one would be
+ * skipped by a readdir in progress.
+ * @return 0 on success, -ENOSPC if the leaf is full, -EIO if it is corrupt.
+ */
+static int leaf_insert(struct inode *dir, struct lab5fs_dir_head *head,
+		       struct inode *child, const char *name, int len)
+{
+	unsigned int off, limit = le16_to_cpu(head->dh_limit);
+	unsigned int need = LAB5FS_DIR_REC_LEN(len), used, rec_len;
+	struct lab5fs_dir *de, *new_de;
+
+	for (off = 0; off < limit; off += rec_len) {
+		if (!(de = leaf_rec(dir, head, off)))
+			return -EIO;
+		rec_len = le16_to_cpu(de->dir_rec_len);
+		used = de->dir_inode ? LAB5FS_DIR_REC_LEN(de->dir_name_len) : 0;
+		if (rec_len - used >= need)
+			goto found;
+	}
+	return -ENOSPC;
+
+  found:
+	/* split the slack off into a record of its own. */
+	if (used) {
+		new_de = (struct lab5fs_dir *)((char *)de + used);
+		new_de->dir_rec_len = cpu_to_le16(rec_len - used);
+		de->dir_rec_len = cpu_to_le16(used);
+		de = new_de;
+	}
+	de->dir_inode = cpu_to_le32(child->i_ino);
+	de->dir_name_len = len;
+	de->dir_file_type = lab5fs_type_by_mode[(child->i_mode & S_IFMT) >> S_SHIFT];
+	memcpy(de->dir_name, name, len);
+	head->dh_count = cpu_to_le16(le16_to_cpu(head->dh_count) + 1);
+	return 0;
+}
+
+/*
+ * Remove a record from a leaf, giving its space to the record before it
+ * so free space stays in as few pieces as possible.
+ */
+static void leaf_delete(struct lab5fs_dir_head *head, struct lab5fs_dir *de,
+			struct lab5fs_dir *prev)
+{
+	if (prev)
+		prev->dir_rec_len = cpu_to_le16(le16_to_cpu(prev->dir_rec_len) +
+						le16_to_cpu(de->dir_rec_len));
+	else
+		de->dir_inode = 0;
+	head->dh_count = cpu_to_le16(le16_to_cpu(head->dh_count) - 1);
+}
+
+/*
+ * Move the full inline leaf of a directory out to blocks: logical block 0
+ * becomes the index root and block 1 its only leaf, which takes over the
+ * inline records at the same offsets, the last one growing to the end of
+ * the block.
+ */
+static int lab5fs_dir_uninline(struct inode *dir)
+{
+	struct lab5fs_inode_info *info = LAB5FS_INODE_INFO(dir);
+	struct lab5fs_dir_head *ihead = INLINE_HEAD(dir), *head;
+	struct buffer_head *root_bh, *leaf_bh;
+	unsigned long root_lblk, leaf_lblk;
+	unsigned int off, limit;
+	int err;
+
+	lab5fs_dbg("directory %lu outgrew its inline leaf\n", dir->i_ino);
+
+	dir->i_size = 0;
+	if (!(root_bh = lab5fs_dir_new_block(dir, LAB5FS_DX_MAGIC,
+					     &root_lblk, &err)))
+		goto fail;
+	if (!(leaf_bh = lab5fs_dir_new_block(dir, LAB5FS_DIR_LEAF_MAGIC,
+					     &leaf_lblk, &err))) {
+		brelse(root_bh);
+		goto fail;
+	}
+
+	head = DIR_HEAD(leaf_bh);
+	limit = le16_to_cpu(ihead->dh_limit);
+	memcpy(DIR_REC(head, 0), DIR_REC(ihead, 0), limit);
+	for (off = 0; off + le16_to_cpu(DIR_REC(head, off)->dir_rec_len) < limit;
+	     off += le16_to_cpu(DIR_REC(head, off)->dir_rec_len))
+		;
+	DIR_REC(head, off)->dir_rec_len = cpu_to_le16(LAB5FS_DIR_SPACE - off);
+	head->dh_count = ihead->dh_count;
+	lab5fs_journal_dirty(dir->i_sb, dir, leaf_bh);
+	brelse(leaf_bh);
+
+	head = DIR_HEAD(root_bh);
+	DX_ENTRIES(head)[0].de_hash = 0;
+	DX_ENTRIES(head)[0].de_block = cpu_to_le32(leaf_lblk);
+	head->dh_count = cpu_to_le16(1);
+	head->dh_levels = cpu_to_le16(1);
+	lab5fs_journal_dirty(dir->i_sb, dir, root_bh);
+	brelse(root_bh);
+
+	info->i_flags &= ~LAB5FS_INLINE_DATA_FL;
+	memset(info->i_inline, 0, sizeof(info->i_inline));
+	mark_inode_dirty(dir);
+	return 0;
+
+  fail:
+	/* give back a half-built index; the records are still inline. Its
+	 * blocks were allocated in this handle, so freeing them needs no
+	 * restart. */
+	down(&info->i_map_sem);
+	lab5fs_extent_truncate(dir, 0, 0);
+	up(&info->i_map_sem);
+	dir->i_size = 0;
+	mark_inode_dirty(dir);
+	return err;
+}
+
+/* Insert a child index entry right after the one at frame->pos. */
+static void dx_insert(struct inode *dir, struct lab5fs_dx_frame *frame,
+		      u32 hash, unsigned long lblk)
+{
+	struct lab5fs_dx_entry *entries = DX_ENTRIES(frame->head);
+	int count = le16_to_cpu(frame->head->dh_count);
+	int pos = frame->pos + 1;
+
+	memmove(entries + pos + 1, entries + pos,
+		(count - pos) * sizeof(struct lab5fs_dx_entry));
+	entries[pos].de_hash = cpu_to_le32(hash);
+	entries[pos].de_block = cpu_to_le32(lblk);
+	frame->head->dh_count = cpu_to_le16(count + 1);
+	lab5fs_journal_dirty(dir->i_sb, dir, frame->bh);
+}
+
+/*
+ * Copy the records of src at the given offsets into the empty leaf head,
+ * packed, the last one taking the rest of the leaf.
+ */
+static void leaf_fill(struct lab5fs_dir_head *head, struct lab5fs_dir_head *src,
+		      u16 *offs, int n)
+{
+	unsigned int to = 0, len;
+	struct lab5fs_dir *de;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		de = DIR_REC(src, offs[i]);
+		len = LAB5FS_DIR_REC_LEN(de->dir_name_len);
+		memcpy(DIR_REC(head, to), de, len);
+		DIR_REC(head, to)->dir_rec_len = cpu_to_le16(i + 1 < n ? len :
+						 le16_to_cpu(head->dh_limit) - to);
+		to += len;
+	}
+	head->dh_count = cpu_to_le16(n);
+}
+
+/*
+ * Split a full leaf: sort its records by hash and move the upper half
+ * into a new leaf, packed, which is linked into the parent index block.
+ * The records that stay keep their offsets, the space of the moved ones
+ * going to the records before them, so a readdir in progress still
+ * finds every name that was not moved; a moved name may show up twice.
+ */
+static int dx_split_leaf(struct inode *dir, struct lab5fs_dx_frame *parent,
+			 struct buffer_head *bh)
+{
+	struct lab5fs_dir_head *head = DIR_HEAD(bh);
+	struct lab5fs_dir_head *copy = NULL;
+	struct lab5fs_dir *de, *prev;
+	struct buffer_head *new_bh;
+	u32 hashes[LAB5FS_DIR_MAX_RECS], h;
+	u16 order[LAB5FS_DIR_MAX_RECS];
+	unsigned long new_lblk;
+	unsigned int off, next;
+	int n = 0, j, split, err = 0;
+
+	copy = kmalloc(LAB5FS_BLOCK_SIZE, GFP_KERNEL);
+	if (!copy)
+		return -ENOMEM;
+	memcpy(copy, head, LAB5FS_BLOCK_SIZE);
+
+	/* insertion sort of the live records by hash. */
+	for (off = 0; off < LAB5FS_DIR_SPACE; off += le16_to_cpu(de->dir_rec_len)) {
+		if (!(de = leaf_rec(dir, copy, off))) {
+			err = -EIO;
+			goto out;
+		}
+		if (de->dir_inode == 0)
+			continue;
+		h = lab5fs_dx_hash(de->dir_name, de->dir_name_len);
+		for (j = n; j > 0 && hashes[j - 1] > h; j--) {
+			hashes[j] = hashes[j - 1];
+			order[j] = order[j - 1];
+		}
+		hashes[j] = h;
+		order[j] = off;
+		n++;
+	}
+
+	/* split in the middle, but never between two equal hashes. */
+	split = n / 2;
+	while (split > 0 && split < n && hashes[split] == hashes[split - 1])
+		split++;
+	if (split == n) {
+		split = n / 2;
+		while (split > 0 && hashes[split] == hashes[split - 1])
+			split--;
+	}
+	if (split == 0) {
+		printk("directory %lu: leaf holds a single hash value\n",
+		       dir->i_ino);
+		err = -ENOSPC;
+		goto out;
+	}
+
+	if (!(new_bh = lab5fs_dir_new_block(dir, LAB5FS_DIR_LEAF_MAGIC,
+					    &new_lblk, &err)))
+		goto out;
+	leaf_fill(DIR_HEAD(new_bh), copy, order + split, n - split);
+	lab5fs_journal_dirty(dir->i_sb, dir, new_bh);
+	brelse(new_bh);
+
+	prev = NULL;
+	for (off = 0; off < LAB5FS_DIR_SPACE; off = next) {
+		de = DIR_REC(head, off);
+		next = off + le16_to_cpu(de->dir_rec_len);
+		if (de->dir_inode != 0 &&
+		    lab5fs_dx_hash(de->dir_name, de->dir_name_len) >= hashes[split]) {
+			leaf_delete(head, de, prev);
+			if (prev)
+				continue;
+		}
+		prev = de;
+	}
+	lab5fs_journal_dirty(dir->i_sb, dir, bh);
+
+	dx_insert(dir, parent, hashes[split], new_lblk);
+
+  out:
+	kfree(copy);
+	return err;
+}
+
+/*
+ * The root index is full and points straight at leaves: move its entries
+ * into a new index block and make that block the root's only child.
+ */
+static int dx_grow_root(struct inode *dir, struct lab5fs_dx_frame *root)
+{
+	struct lab5fs_dir_head *head;
+	struct buffer_head *bh;
+	unsigned long lblk;
+	int count = le16_to_cpu(root->head->dh_count);
+	int err;
+
+	if (!(bh = lab5fs_dir_new_block(dir, LAB5FS_DX_MAGIC, &lblk, &err)))
+		return err;
+	head = DIR_HEAD(bh);
+	memcpy(DX_ENTRIES(head), DX_ENTRIES(root->head),
+	       count * sizeof(struct lab5fs_dx_entry));
+	head->dh_count = cpu_to_le16(count);
+	head->dh_levels = cpu_to_le16(1);
+	lab5fs_journal_dirty(dir->i_sb, dir, bh);
+	brelse(bh);
+
+	DX_ENTRIES(root->head)[0].de_hash = 0;
+	DX_ENTRIES(root->head)[0].de_block = cpu_to_le32(lblk);
+	root->head->dh_count = cpu_to_le16(1);
+	root->head->dh_levels = cpu_to_le16(2);
+	lab5fs_journal_dirty(dir->i_sb, dir, root->bh);
+	return 0;
+}
+
+/* Split the full second-level index block under the root in two. */
+static int dx_split_index(struct inode *dir, struct lab5fs_dx_frame *frames)
+{
+	struct lab5fs_dir_head *old = frames[1].head;
+	struct lab5fs_dir_head *head;
+	struct buffer_head *bh;
+	unsigned long lblk;
+	int count = le16_to_cpu(old->dh_count);
+	int split = count / 2;
+	u32 hash = le32_to_cpu(DX_ENTRIES(old)[split].de_hash);
+	int err;
+
+	if (!(bh = lab5fs_dir_new_block(dir, LAB5FS_DX_MAGIC, &lblk, &err)))
+		return err;
+	head = DIR_HEAD(bh);
+	memcpy(DX_ENTRIES(head), DX_ENTRIES(old) + split,
+	       (count - split) * sizeof(struct lab5fs_dx_entry));
+	head->dh_count = cpu_to_le16(count - split);
+	head->dh_levels = cpu_to_le16(1);
+	lab5fs_journal_dirty(dir->i_sb, dir, bh);
+	brelse(bh);
+
+	old->dh_count = cpu_to_le16(split);
+	lab5fs_journal_dirty(dir->i_sb, dir, frames[1].bh);
+
+	dx_insert(dir, &frames[0], hash, lblk);
+	return 0;
+}
+
+/*Find the inode number of the file specified by char *name */
+int lab5fs_getfile(struct inode *dir, const char *name, int len, ino_t *ino) {
+	int err = 0;
+	struct lab5fs_dx_frame frames[LAB5FS_DX_MAX_LEVELS];
+	struct buffer_head *bh = NULL;
+	struct lab5fs_dir *de;
+	unsigned long leaf;
+	int levels;
+	*ino=0;
+	lab5fs_dbg("lab5fs_getfile:: name: %s, len: %d\n", name, len);
+
+	if (LAB5FS_INODE_INLINE(dir)) {
+		de = leaf_find(dir, INLINE_HEAD(dir), name, len, NULL, &err);
+		if (de)
+			*ino = le32_to_cpu(de->dir_inode);
+		return err;
+	}
+
+	levels = dx_probe(dir, lab5fs_dx_hash(name, len), frames, &leaf);
+	if (levels < 0)
+		return levels;
+	dx_release(frames);
+
+	lab5fs_dbg("lab5fs_getfile leaf block: %lu\n", leaf);
+	if (!(bh = dx_leaf(dir, leaf, &err)))
+		return err;
+
+	de = leaf_find(dir, DIR_HEAD(bh), name, len, NULL, &err);
+	if (de)
+		*ino = le32_to_cpu(de->dir_inode);
+
+	brelse(bh);
+	return err;
+}
+
+/* List a directory's files */
+/* inode table blocks lab5fs_dir_readahead submits at a time */
+#define LAB5FS_READAHEAD_BATCH 32
+
+/*
+ * Start reading the inode table blocks of the records of a leaf from
+ * offset start on, so that the stat of each name that usually follows a
+ * listing finds its inode block in the buffer cache. The reads go out as
+ * one batch and are not waited for.
+ */
+static void lab5fs_dir_readahead(struct inode *dir, struct lab5fs_dir_head *head,
+				 unsigned int start)
+{
+	struct super_block *sb = dir->i_sb;
+	struct buffer_head *batch[LAB5FS_READAHEAD_BATCH], *bh;
+	unsigned long block_num, prev = 0, offset;
+	unsigned int off, limit = le16_to_cpu(head->dh_limit);
+	struct lab5fs_dir *de;
+	int i, nr = 0;
+
+	for (off = 0; off < limit && nr < LAB5FS_READAHEAD_BATCH;
+	     off += le16_to_cpu(de->dir_rec_len)) {
+		if (!(de = leaf_rec(dir, head, off)))
+			break;
+		if (off < start || de->dir_inode == 0)
+			continue;
+		block_num = lab5fs_inode_block(sb, le32_to_cpu(de->dir_inode), &offset);
+		if (block_num == 0 || block_num == prev)
+			continue;
+		prev = block_num;
+		for (i = 0; i < nr && batch[i]->b_blocknr != block_num; i++)
+			;
+		if (i < nr)
+			continue;
+		if (!(bh = sb_getblk(sb, block_num)))
+			break;
+		if (buffer_uptodate(bh)) {
+			brelse(bh);
+			continue;
+		}
+		batch[nr++] = bh;
+	}
+
+	if (nr)
+		ll_rw_block(READA, nr, batch);
+	for (i = 0; i < nr; i++)
+		brelse(batch[i]);
+}
+
+/*
+ * Hand the records of a leaf at offset start or later to filldir, with
+ * f_pos base + offset.
+ * @return 0 once the leaf is done, 1 if filldir is full, -EIO if the
+ * leaf is corrupt.
+ */
+static int leaf_readdir(struct file *filep, struct lab5fs_dir_head *head,
+			unsigned long base, unsigned int start,
+			void *dirent, filldir_t filldir)
+{
+	struct inode *inode = filep->f_dentry->d_inode;
+	unsigned int off, limit = le16_to_cpu(head->dh_limit);
+	struct lab5fs_dir *de;
+
+	lab5fs_dir_readahead(inode, head, start);
+	for (off = 0; off < limit; off += le16_to_cpu(de->dir_rec_len)) {
+		if (!(de = leaf_rec(inode, head, off)))
+			return -EIO;
+		if (off < start || de->dir_inode == 0) //skip free space indicated by inode==0
+			continue;
+		filep->f_pos = base + off;
+		if (filldir(dirent, de->dir_name, de->dir_name_len, filep->f_pos,
+			    le32_to_cpu(de->dir_inode), lab5fs_dir_dtype(de)) < 0)
+			return 1;
+		lab5fs_dbg("lab5fs readdir adding %.*s at postion inode=%d\n",de->dir_name_len,de->dir_name,le32_to_cpu(de->dir_inode));
+	}
+	return 0;
+}
+
+int lab5fs_readdir(struct file *filep, void *dirent, filldir_t filldir) {
+	int err = 0;
+	struct dentry *dentry = filep->f_dentry;
+	struct inode *inode = dentry->d_inode;
+	struct buffer_head *bh = NULL;
+	struct lab5fs_dir_head *head;
+	unsigned long lblk, nblocks;
+	unsigned int start;
+	struct timeval op_start;
+
+	lab5fs_stats_start(&op_start);
+	lab5fs_dbg("lab5fs::readdir Reading directory inode=%d file_pos=%d filepath=%s\n",(int)inode->i_ino,(int)filep->f_pos,dentry->d_name.name);
+
+	/*generate . and .. entries*/
+	if(filep->f_pos == 0) {
+		if (filldir(dirent, ".", 1, filep->f_pos, inode->i_ino, DT_DIR) < 0)
+			goto out;
+		filep->f_pos++;
+	}
+
+	if(filep->f_pos == 1) {
+		if (filldir(dirent, "..", 2, filep->f_pos, dentry->d_parent->d_inode->i_ino, DT_DIR) < 0)
+			goto out;
+		filep->f_pos++;
+	}
+
+	/*
+	 * f_pos - 2 is the byte offset of a record within the directory.
+	 * Records never move to a lower offset (see leaf_insert and
+	 * dx_split_leaf), so a position stays valid while names come and go.
+	 * An inline leaf uses the positions of logical block 1, where its
+	 * records end up once the directory outgrows the inode.
+	 */
+	if (LAB5FS_INODE_INLINE(inode)) {
+		start = 0;
+		if (filep->f_pos >= 2 + LAB5FS_BLOCK_SIZE)
+			start = filep->f_pos - 2 - LAB5FS_BLOCK_SIZE;
+		err = leaf_readdir(filep, INLINE_HEAD(inode), 2 + LAB5FS_BLOCK_SIZE,
+				   start, dirent, filldir);
+		if (err == 0)
+			filep->f_pos = 2 + 2 * LAB5FS_BLOCK_SIZE;
+		goto out;
+	}
+
+	/* walk the leaves in block order. */
+	nblocks = inode->i_size >> LAB5FS_BITS;
+	lblk = (filep->f_pos - 2) >> LAB5FS_BITS;
+	start = (filep->f_pos - 2) & (LAB5FS_BLOCK_SIZE - 1);
+	for (; lblk < nblocks; lblk++, start = 0) {
+		if (!(bh = lab5fs_dir_bread(inode, lblk, &err)))
+			goto out;
+		head = DIR_HEAD(bh);
+		if (le16_to_cpu(head->dh_magic) != LAB5FS_DIR_LEAF_MAGIC) {
+			brelse(bh);
+			continue; /*index blocks hold no names*/
+		}
+		err = leaf_readdir(filep, head, 2 + (lblk << LAB5FS_BITS), start,
+				   dirent, filldir);
+		brelse(bh);
+		if (err)
+			goto out;
+	}
+	filep->f_pos = 2 + (nblocks << LAB5FS_BITS);
+out:
+	lab5fs_stats_end(inode->i_sb, LAB5FS_OP_READDIR, &op_start);
+	return err < 0 ? err : 0;
+}
+
+/*
+ * Given a directory's inode and a child inode, write a directory struct to
+ * the leaf block its name hashes to, splitting blocks as needed.
+ * @return 0 on success, a negative error code on failure.
+ */
+int lab5fs_dir_add_link(struct inode *parent_dir, struct inode *child,
+                        const char *name, int namelen)
+{
+        int err = 0;
+        struct lab5fs_dx_frame frames[LAB5FS_DX_MAX_LEVELS];
+        struct buffer_head *data_bh = NULL;
+        u32 hash = lab5fs_dx_hash(name, namelen);
+        unsigned long leaf;
+        int levels;
+
+	lab5fs_dbg("Adding link, inode %lu -> inode %lu, name=%.*s\n",
+                   parent_dir->i_ino, child->i_ino, namelen, name);
+
+        /* sanity checks. */
+        if (namelen > LAB5FS_MAX_FNAME)
+                return -ENAMETOOLONG;
+
+        if (LAB5FS_INODE_INLINE(parent_dir)) {
+                err = leaf_insert(parent_dir, INLINE_HEAD(parent_dir), child,
+                                  name, namelen);
+                if (err != -ENOSPC) {
+                        if (err)
+                                return err;
+                        parent_dir->i_mtime = parent_dir->i_ctime = CURRENT_TIME;
+                        mark_inode_dirty(parent_dir);
+                        return 0;
+                }
+                if ((err = lab5fs_dir_uninline(parent_dir)))
+                        return err;
+        }
+
+        for (;;) {
+                levels = dx_probe(parent_dir, hash, frames, &leaf);
+                if (levels < 0)
+                        return levels;
+
+                if (!(data_bh = dx_leaf(parent_dir, leaf, &err)))
+                        goto ret;
+                err = leaf_insert(parent_dir, DIR_HEAD(data_bh), child, name,
+                                  namelen);
+                if (err != -ENOSPC)
+                        break;
+
+                /* the leaf is full - make room and look again. */
+                if (le16_to_cpu(frames[levels - 1].head->dh_count) < LAB5FS_DX_LIMIT)
+                        err = dx_split_leaf(parent_dir, &frames[levels - 1], data_bh);
+                else if (levels < LAB5FS_DX_MAX_LEVELS)
+                        err = dx_grow_root(parent_dir, &frames[0]);
+                else if (le16_to_cpu(frames[0].head->dh_count) < LAB5FS_DX_LIMIT)
+                        err = dx_split_index(parent_dir, frames);
+                else
+                        err = -ENOSPC;
+
+                brelse(data_bh);
+                data_bh = NULL;
+                dx_release(frames);
+                if (err) {
+                        printk("Out of directory space in inode %lu\n",
+                               parent_dir->i_ino);
+                        return err;
+                }
+        }
+
+        if (err)
+                goto ret;
+        lab5fs_journal_dirty(parent_dir->i_sb, parent_dir, data_bh);
+        parent_dir->i_mtime = parent_dir->i_ctime = CURRENT_TIME;
+        mark_inode_dirty(parent_dir);
+
+  ret:
+        dx_release(frames);
+        if (data_bh)
+                brelse(data_bh);
+        return err;
+}
+
+
+/*
+ * Given a directory's inode and a child inode, remove this child inode from
+ * the directory's list-of-entries.
+ * @return 0 on success, a negative error code on failure.
+ */
+int lab5fs_dir_del_link(struct inode *parent_dir, struct inode *child,
+                        const char *name, int namelen)
+{
+        int err = 0;
+        struct lab5fs_dx_frame frames[LAB5FS_DX_MAX_LEVELS];
+        struct buffer_head *data_bh = NULL;
+        struct lab5fs_dir_head *head;
+        struct lab5fs_dir *dir_rec, *prev;
+        unsigned long leaf;
+        int levels;
+
+        lab5fs_dbg("lab5fs Removing link, inode %lu -/-> inode %lu, name=%.*s\n",
+                   parent_dir->i_ino, child->i_ino, namelen, name);
+
+        if (LAB5FS_INODE_INLINE(parent_dir)) {
+                head = INLINE_HEAD(parent_dir);
+                dir_rec = leaf_find(parent_dir, head, name, namelen, &prev, &err);
+                if (!dir_rec)
+                        return err ? err : -ENOENT;
+                leaf_delete(head, dir_rec, prev);
+                parent_dir->i_mtime = parent_dir->i_ctime = CURRENT_TIME;
+                mark_inode_dirty(parent_dir);
+                return 0;
+        }
+
+        levels = dx_probe(parent_dir, lab5fs_dx_hash(name, namelen), frames, &leaf);
+        if (levels < 0)
+                return levels;
+        dx_release(frames);
+
+        /* find the child's entry in the leaf its name hashes to. */
+        if (!(data_bh = dx_leaf(parent_dir, leaf, &err)))
+                return err;
+        head = DIR_HEAD(data_bh);
+
+        dir_rec = leaf_find(parent_dir, head, name, namelen, &prev, &err);
+        if (!dir_rec) {
+                if (!err)
+                        err = -ENOENT;
+                goto ret;
+        }
+
+        /* fold the entry's space into its neighbour. */
+        leaf_delete(head, dir_rec, prev);
+        lab5fs_journal_dirty(parent_dir->i_sb, parent_dir, data_bh);
+
+        parent_dir->i_mtime = parent_dir->i_ctime = CURRENT_TIME;
+        mark_inode_dirty(parent_dir);
+
+  ret:
+        brelse(data_bh);
+        return err;
+}
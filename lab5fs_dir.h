@@ -0,0 +1,22 @@
+#ifndef LAB5FS_DIR_H
+#define LAB5FS_DIR_H
+
+#include <linux/fs.h>
+#include <linux/types.h>
+
+struct lab5fs_dir_head;
+
+/*
+ * Hash-indexed directories. The caller must hold the directory's i_mutex.
+ */
+int lab5fs_getfile(struct inode *dir, const char *name, int len, ino_t *ino); //finds the inode number of a name
+int lab5fs_dir_add_link(struct inode *parent_dir, struct inode *child,
+                        const char *name, int namelen); //adds a name to a directory
+int lab5fs_dir_del_link(struct inode *parent_dir, struct inode *child,
+                        const char *name, int namelen); //removes a name from a directory
+void lab5fs_dir_init_leaf(struct lab5fs_dir_head *head, int space); //makes an empty leaf of space bytes
+
+/*operations*/
+int lab5fs_readdir(struct file *filep, void *dirent, filldir_t fill);
+
+#endif /* LAB5FS_DIR_H */
@@ -0,0 +1,740 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/errno.h>
+#include <linux/string.h>
+#include "lab5fs.h"
+#include "lab5fs_super.h"
+#include "lab5fs_inode.h"
+#include "lab5fs_extent.h"
+#include "lab5fs_journal.h"
+
+/*
+ * A file's block map is a tree of extents rooted in the inode. The root
+ * holds LAB5FS_INODE_EXTENTS entries; when it fills up, its entries are
+ * pushed down into a new extent block and the root becomes an index
+ * pointing at that block. Full extent blocks are split in two. Entries in
+ * every node are sorted by logical block, and leaves and index entries
+ * have the same size and start with the logical block, so searches and
+ * moves treat both alike.
+ */
+
+/* number of entries that fit in an extent block */
+#define LAB5FS_EXTENTS_PER_BLOCK \
+	((LAB5FS_BLOCK_SIZE - sizeof(struct lab5fs_extent_header)) / \
+	 sizeof(struct lab5fs_extent))
+
+#define EXT_HDR(bh) ((struct lab5fs_extent_header *)((bh)->b_data))
+#define EXT_FIRST(hdr) ((struct lab5fs_extent *)((hdr) + 1))
+#define EXT_IDX_FIRST(hdr) ((struct lab5fs_extent_idx *)((hdr) + 1))
+
+/* one level of a root-to-leaf walk */
+struct lab5fs_ext_path {
+	struct buffer_head *p_bh;            /* NULL for the root in the inode */
+	struct lab5fs_extent_header *p_hdr;
+	int p_pos;                           /* entry covering the block, -1 if none */
+};
+
+static struct lab5fs_extent_header *ext_root(struct inode *ino)
+{
+	return &LAB5FS_INODE_INFO(ino)->i_eh;
+}
+
+/* Index of the last entry starting at or before lblk, -1 if there is none. */
+static int ext_search(struct lab5fs_extent_header *hdr, unsigned long lblk)
+{
+	struct lab5fs_extent *ext = EXT_FIRST(hdr);
+	int lo = 0, hi = le16_to_cpu(hdr->eh_count) - 1, mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (le32_to_cpu(ext[mid].e_logical) <= lblk)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return hi;
+}
+
+static void ext_release_path(struct lab5fs_ext_path *path)
+{
+	int i;
+
+	for (i = 0; i <= LAB5FS_EXTENT_MAX_DEPTH; i++) {
+		if (path[i].p_bh)
+			brelse(path[i].p_bh);
+		path[i].p_bh = NULL;
+	}
+}
+
+/* Mark the node at the given path level as modified. */
+static void ext_dirty(struct inode *ino, struct lab5fs_ext_path *p)
+{
+	if (p->p_bh)
+		lab5fs_journal_dirty(ino->i_sb, ino, p->p_bh);
+	else
+		mark_inode_dirty(ino);
+}
+
+/*
+ * Walk from the root down to the leaf that covers lblk.
+ * @return the depth of the tree, or a negative error code.
+ */
+static int ext_find_path(struct inode *ino, unsigned long lblk,
+			 struct lab5fs_ext_path *path)
+{
+	struct super_block *sb = ino->i_sb;
+	struct lab5fs_extent_header *hdr = ext_root(ino);
+	struct buffer_head *bh;
+	int depth = le16_to_cpu(hdr->eh_depth);
+	int level, pos;
+	unsigned long block_num;
+
+	memset(path, 0, sizeof(*path) * (LAB5FS_EXTENT_MAX_DEPTH + 1));
+	if (depth > LAB5FS_EXTENT_MAX_DEPTH) {
+		printk("inode %lu: extent tree too deep (%d)\n", ino->i_ino, depth);
+		return -EIO;
+	}
+
+	for (level = 0; ; level++) {
+		pos = ext_search(hdr, lblk);
+		path[level].p_hdr = hdr;
+		path[level].p_pos = pos;
+		if (level == depth)
+			break;
+
+		/* blocks before the first index entry live in the first child. */
+		if (le16_to_cpu(hdr->eh_count) == 0) {
+			printk("inode %lu: empty extent index at depth %d\n",
+			       ino->i_ino, level);
+			goto err_io;
+		}
+		if (pos < 0)
+			path[level].p_pos = pos = 0;
+
+		block_num = le32_to_cpu(EXT_IDX_FIRST(hdr)[pos].ei_block);
+		if (!(bh = sb_bread(sb, block_num))) {
+			printk("unable to read extent block %lu.\n", block_num);
+			goto err_io;
+		}
+		path[level + 1].p_bh = bh;
+		hdr = EXT_HDR(bh);
+		if (le16_to_cpu(hdr->eh_magic) != LAB5FS_EXTENT_MAGIC ||
+		    le16_to_cpu(hdr->eh_depth) != depth - level - 1) {
+			printk("bad extent block %lu in inode %lu\n",
+			       block_num, ino->i_ino);
+			goto err_io;
+		}
+	}
+	return depth;
+
+  err_io:
+	ext_release_path(path);
+	return -EIO;
+}
+
+/*
+ * Translations found by lab5fs_extent_map are remembered in a few slots of
+ * the in-core inode, filled round robin, so repeated lookups in the same
+ * extent (directory blocks, sequential I/O) skip the walk through extent
+ * blocks. Any change to the tree drops them. The caller holds i_map_sem.
+ */
+void lab5fs_extent_cache_drop(struct inode *ino)
+{
+	struct lab5fs_inode_info *info = LAB5FS_INODE_INFO(ino);
+
+	memset(info->i_ext_cache, 0, sizeof(info->i_ext_cache));
+	info->i_ext_cache_next = 0;
+	info->i_ext_leaf = 0;
+}
+
+static int ext_cache_lookup(struct inode *ino, unsigned long lblk,
+			    unsigned long *pblk, unsigned long *len)
+{
+	struct lab5fs_ext_cache *ec = LAB5FS_INODE_INFO(ino)->i_ext_cache;
+	int i;
+
+	for (i = 0; i < LAB5FS_EXT_CACHE_SIZE; i++, ec++) {
+		if (ec->ec_len == 0 || lblk < ec->ec_lblk ||
+		    lblk - ec->ec_lblk >= ec->ec_len)
+			continue;
+		*pblk = ec->ec_pblk ? ec->ec_pblk + (lblk - ec->ec_lblk) : 0;
+		*len = ec->ec_len - (lblk - ec->ec_lblk);
+		return 1;
+	}
+	return 0;
+}
+
+static void ext_cache_add(struct inode *ino, unsigned long lblk,
+			  unsigned long pblk, unsigned long len)
+{
+	struct lab5fs_inode_info *info = LAB5FS_INODE_INFO(ino);
+	struct lab5fs_ext_cache *ec = &info->i_ext_cache[info->i_ext_cache_next];
+
+	ec->ec_lblk = lblk;
+	ec->ec_pblk = pblk;
+	ec->ec_len = len;
+	info->i_ext_cache_next = (info->i_ext_cache_next + 1) % LAB5FS_EXT_CACHE_SIZE;
+}
+
+/*
+ * The leaf a walk ends in is remembered too, with the range of logical
+ * blocks the index above it sends there, so a miss in the translation
+ * cache that falls in the same leaf reads just that block instead of
+ * every index block on the way down. A large file read sequentially then
+ * walks the index once per leaf rather than once per extent.
+ */
+static struct buffer_head *ext_leaf_hint(struct inode *ino, unsigned long lblk)
+{
+	struct lab5fs_inode_info *info = LAB5FS_INODE_INFO(ino);
+	struct lab5fs_extent_header *hdr;
+	struct buffer_head *bh;
+
+	if (info->i_ext_leaf == 0 || lblk < info->i_ext_leaf_start ||
+	    lblk >= info->i_ext_leaf_end)
+		return NULL;
+	if (!(bh = sb_bread(ino->i_sb, info->i_ext_leaf)))
+		return NULL;
+	hdr = EXT_HDR(bh);
+	if (le16_to_cpu(hdr->eh_magic) != LAB5FS_EXTENT_MAGIC ||
+	    le16_to_cpu(hdr->eh_depth) != 0) {
+		brelse(bh);
+		info->i_ext_leaf = 0;
+		return NULL;
+	}
+	return bh;
+}
+
+/* Remember the leaf at the end of path, and work out where it ends. */
+static unsigned long ext_leaf_remember(struct inode *ino,
+				       struct lab5fs_ext_path *path, int depth)
+{
+	struct lab5fs_inode_info *info = LAB5FS_INODE_INFO(ino);
+	struct lab5fs_extent_idx *idx;
+	unsigned long start = 0, end = 0xFFFFFFFFUL;
+	int level, pos;
+
+	/* each index entry covers up to its right sibling, and the first
+	 * one also everything its parent sends below it. */
+	for (level = 0; level < depth; level++) {
+		idx = EXT_IDX_FIRST(path[level].p_hdr);
+		pos = path[level].p_pos;
+		if (pos > 0)
+			start = le32_to_cpu(idx[pos].ei_logical);
+		if (pos + 1 < le16_to_cpu(path[level].p_hdr->eh_count))
+			end = le32_to_cpu(idx[pos + 1].ei_logical);
+	}
+	if (depth > 0) {
+		info->i_ext_leaf = path[depth].p_bh->b_blocknr;
+		info->i_ext_leaf_start = start;
+		info->i_ext_leaf_end = end;
+	}
+	return end;
+}
+
+/* Set up an empty extent tree in a freshly created inode. */
+void lab5fs_extent_init_root(struct inode *ino)
+{
+	struct lab5fs_extent_header *hdr = ext_root(ino);
+
+	memset(hdr, 0, sizeof(*hdr) +
+	       LAB5FS_INODE_EXTENTS * sizeof(struct lab5fs_extent));
+	hdr->eh_magic = cpu_to_le16(LAB5FS_EXTENT_MAGIC);
+	hdr->eh_max = cpu_to_le16(LAB5FS_INODE_EXTENTS);
+	lab5fs_extent_cache_drop(ino);
+}
+
+/*
+ * Translate logical block lblk. On return *pblk holds the disk block (0
+ * for a hole) and *len the number of blocks from lblk on that share the
+ * same state: the rest of the extent, or the distance to the next one.
+ * @return 0 on success, a negative error code on failure.
+ */
+int lab5fs_extent_map(struct inode *ino, unsigned long lblk,
+		      unsigned long *pblk, unsigned long *len)
+{
+	struct lab5fs_ext_path path[LAB5FS_EXTENT_MAX_DEPTH + 1];
+	struct lab5fs_extent_header *hdr;
+	struct lab5fs_extent *ext;
+	struct buffer_head *leaf_bh;
+	unsigned long start, elen, leaf_end;
+	int depth, pos;
+
+	if (ext_cache_lookup(ino, lblk, pblk, len))
+		return 0;
+
+	*pblk = 0;
+	*len = 0;
+
+	memset(path, 0, sizeof(path));
+	if ((leaf_bh = ext_leaf_hint(ino, lblk))) {
+		hdr = EXT_HDR(leaf_bh);
+		pos = ext_search(hdr, lblk);
+		leaf_end = LAB5FS_INODE_INFO(ino)->i_ext_leaf_end;
+	} else {
+		depth = ext_find_path(ino, lblk, path);
+		if (depth < 0)
+			return depth;
+		hdr = path[depth].p_hdr;
+		pos = path[depth].p_pos;
+		leaf_end = ext_leaf_remember(ino, path, depth);
+	}
+
+	if (pos >= 0) {
+		ext = &EXT_FIRST(hdr)[pos];
+		start = le32_to_cpu(ext->e_logical);
+		elen = le32_to_cpu(ext->e_len);
+		if (lblk < start + elen) {
+			*pblk = le32_to_cpu(ext->e_physical) + (lblk - start);
+			*len = start + elen - lblk;
+			ext_cache_add(ino, start, le32_to_cpu(ext->e_physical), elen);
+			goto ret;
+		}
+	}
+
+	/* a hole - it ends where the next extent, or the next leaf, begins. */
+	if (pos + 1 < le16_to_cpu(hdr->eh_count))
+		*len = le32_to_cpu(EXT_FIRST(hdr)[pos + 1].e_logical) - lblk;
+	else
+		*len = leaf_end - lblk;
+	ext_cache_add(ino, lblk, 0, *len);
+
+  ret:
+	if (leaf_bh)
+		brelse(leaf_bh);
+	ext_release_path(path);
+	return 0;
+}
+
+/* Start a new extent block holding entries of the given node height. */
+static struct buffer_head *ext_new_block(struct inode *ino, int depth,
+					 int *err)
+{
+	struct super_block *sb = ino->i_sb;
+	struct buffer_head *bh;
+	struct lab5fs_extent_header *hdr;
+	int block_num;
+
+	block_num = lab5fs_alloc_block_num(sb);
+	if (block_num == 0) {
+		*err = -ENOSPC;
+		return NULL;
+	}
+	if (!(bh = sb_getblk(sb, block_num))) {
+		lab5fs_release_block_num(sb, block_num);
+		*err = -EIO;
+		return NULL;
+	}
+
+	lock_buffer(bh);
+	memset(bh->b_data, 0, LAB5FS_BLOCK_SIZE);
+	hdr = EXT_HDR(bh);
+	hdr->eh_magic = cpu_to_le16(LAB5FS_EXTENT_MAGIC);
+	hdr->eh_max = cpu_to_le16(LAB5FS_EXTENTS_PER_BLOCK);
+	hdr->eh_depth = cpu_to_le16(depth);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	lab5fs_journal_dirty(ino->i_sb, ino, bh);
+
+	ino->i_blocks++;
+	*err = 0;
+	return bh;
+}
+
+/*
+ * The root is full: move its entries into a new block and turn the root
+ * into a single-entry index over that block.
+ */
+static int ext_grow(struct inode *ino)
+{
+	struct lab5fs_extent_header *root = ext_root(ino);
+	struct lab5fs_extent_header *hdr;
+	struct lab5fs_extent_idx *idx;
+	struct buffer_head *bh;
+	int depth = le16_to_cpu(root->eh_depth);
+	int count = le16_to_cpu(root->eh_count);
+	int err;
+
+	if (depth >= LAB5FS_EXTENT_MAX_DEPTH) {
+		printk("inode %lu: extent tree is at its maximum depth\n",
+		       ino->i_ino);
+		return -EFBIG;
+	}
+
+	if (!(bh = ext_new_block(ino, depth, &err)))
+		return err;
+	hdr = EXT_HDR(bh);
+	memcpy(EXT_FIRST(hdr), EXT_FIRST(root),
+	       count * sizeof(struct lab5fs_extent));
+	hdr->eh_count = cpu_to_le16(count);
+	lab5fs_journal_dirty(ino->i_sb, ino, bh);
+
+	/* the leftmost child covers everything below its right sibling. */
+	idx = EXT_IDX_FIRST(root);
+	idx->ei_logical = 0;
+	idx->ei_block = cpu_to_le32(bh->b_blocknr);
+	idx->ei_unused = 0;
+	root->eh_count = cpu_to_le16(1);
+	root->eh_depth = cpu_to_le16(depth + 1);
+	mark_inode_dirty(ino);
+
+	brelse(bh);
+	return 0;
+}
+
+/*
+ * Split the full node at path[at] and link the new half into its parent,
+ * which must have a free slot. When lblk lies past every entry of the node
+ * (a file growing at its end), only the last entry moves, so appending
+ * files keep their extent blocks full.
+ */
+static int ext_split(struct inode *ino, struct lab5fs_ext_path *path, int at,
+		     unsigned long lblk)
+{
+	struct lab5fs_extent_header *hdr = path[at].p_hdr;
+	struct lab5fs_extent_header *parent = path[at - 1].p_hdr;
+	struct lab5fs_extent_header *new_hdr;
+	struct lab5fs_extent *ext = EXT_FIRST(hdr);
+	struct lab5fs_extent_idx *idx;
+	struct buffer_head *bh;
+	int count = le16_to_cpu(hdr->eh_count);
+	int pcount = le16_to_cpu(parent->eh_count);
+	int pos = path[at - 1].p_pos + 1;
+	int split, err;
+
+	if (lblk > le32_to_cpu(ext[count - 1].e_logical))
+		split = count - 1;
+	else
+		split = count / 2;
+
+	if (!(bh = ext_new_block(ino, le16_to_cpu(hdr->eh_depth), &err)))
+		return err;
+	new_hdr = EXT_HDR(bh);
+	memcpy(EXT_FIRST(new_hdr), ext + split,
+	       (count - split) * sizeof(struct lab5fs_extent));
+	new_hdr->eh_count = cpu_to_le16(count - split);
+	lab5fs_journal_dirty(ino->i_sb, ino, bh);
+
+	hdr->eh_count = cpu_to_le16(split);
+	ext_dirty(ino, &path[at]);
+
+	idx = EXT_IDX_FIRST(parent);
+	memmove(idx + pos + 1, idx + pos,
+		(pcount - pos) * sizeof(struct lab5fs_extent_idx));
+	idx[pos].ei_logical = EXT_FIRST(new_hdr)->e_logical;
+	idx[pos].ei_block = cpu_to_le32(bh->b_blocknr);
+	idx[pos].ei_unused = 0;
+	parent->eh_count = cpu_to_le16(pcount + 1);
+	ext_dirty(ino, &path[at - 1]);
+
+	brelse(bh);
+	return 0;
+}
+
+/* Make sure the leaf that lblk belongs to has room for one more entry. */
+static int ext_make_room(struct inode *ino, unsigned long lblk)
+{
+	struct lab5fs_ext_path path[LAB5FS_EXTENT_MAX_DEPTH + 1];
+	struct lab5fs_extent_header *hdr;
+	int depth, level, err;
+
+	for (;;) {
+		depth = ext_find_path(ino, lblk, path);
+		if (depth < 0)
+			return depth;
+
+		/* find the lowest level that is not full. */
+		for (level = depth; level >= 0; level--) {
+			hdr = path[level].p_hdr;
+			if (le16_to_cpu(hdr->eh_count) < le16_to_cpu(hdr->eh_max))
+				break;
+		}
+
+		if (level == depth)
+			err = 0;
+		else if (level < 0)
+			err = ext_grow(ino);
+		else
+			err = ext_split(ino, path, level + 1, lblk);
+
+		ext_release_path(path);
+		if (err || level == depth)
+			return err;
+	}
+}
+
+/*
+ * Map len blocks starting at logical block lblk to the disk blocks starting
+ * at pblk. The range must not be mapped yet. Runs that continue an existing
+ * extent on disk are merged into it.
+ * @return 0 on success, a negative error code on failure.
+ */
+int lab5fs_extent_insert(struct inode *ino, unsigned long lblk,
+			 unsigned long pblk, unsigned long len)
+{
+	struct lab5fs_ext_path path[LAB5FS_EXTENT_MAX_DEPTH + 1];
+	struct lab5fs_extent_header *hdr;
+	struct lab5fs_extent *ext;
+	int depth, count, pos, err;
+
+	/* the run may fill a cached hole. */
+	lab5fs_extent_cache_drop(ino);
+
+	depth = ext_find_path(ino, lblk, path);
+	if (depth < 0)
+		return depth;
+	hdr = path[depth].p_hdr;
+	ext = EXT_FIRST(hdr);
+	count = le16_to_cpu(hdr->eh_count);
+	pos = path[depth].p_pos;
+
+	/* extend the preceding extent... */
+	if (pos >= 0 &&
+	    le32_to_cpu(ext[pos].e_logical) + le32_to_cpu(ext[pos].e_len) == lblk &&
+	    le32_to_cpu(ext[pos].e_physical) + le32_to_cpu(ext[pos].e_len) == pblk) {
+		ext[pos].e_len = cpu_to_le32(le32_to_cpu(ext[pos].e_len) + len);
+		ext_dirty(ino, &path[depth]);
+		ext_release_path(path);
+		return 0;
+	}
+
+	/* ...or the following one. */
+	if (pos + 1 < count &&
+	    lblk + len == le32_to_cpu(ext[pos + 1].e_logical) &&
+	    pblk + len == le32_to_cpu(ext[pos + 1].e_physical)) {
+		ext[pos + 1].e_logical = cpu_to_le32(lblk);
+		ext[pos + 1].e_physical = cpu_to_le32(pblk);
+		ext[pos + 1].e_len = cpu_to_le32(le32_to_cpu(ext[pos + 1].e_len) + len);
+		ext_dirty(ino, &path[depth]);
+		ext_release_path(path);
+		return 0;
+	}
+	ext_release_path(path);
+
+	/* a new extent is needed. */
+	err = ext_make_room(ino, lblk);
+	if (err)
+		return err;
+
+	depth = ext_find_path(ino, lblk, path);
+	if (depth < 0)
+		return depth;
+	hdr = path[depth].p_hdr;
+	ext = EXT_FIRST(hdr);
+	count = le16_to_cpu(hdr->eh_count);
+	pos = path[depth].p_pos + 1;
+
+	memmove(ext + pos + 1, ext + pos,
+		(count - pos) * sizeof(struct lab5fs_extent));
+	ext[pos].e_logical = cpu_to_le32(lblk);
+	ext[pos].e_physical = cpu_to_le32(pblk);
+	ext[pos].e_len = cpu_to_le32(len);
+	hdr->eh_count = cpu_to_le16(count + 1);
+	ext_dirty(ino, &path[depth]);
+
+	ext_release_path(path);
+	return 0;
+}
+
+/*
+ * Unmap logical block lblk and free its disk block, leaving a hole. A
+ * block in the middle of an extent splits it in two; room for the second
+ * half is made before anything changes, so a failure leaves the tree as
+ * it was.
+ * @return 0 on success (also if lblk was a hole already), a negative
+ * error code on failure.
+ */
+int lab5fs_extent_punch(struct inode *ino, unsigned long lblk)
+{
+	struct lab5fs_ext_path path[LAB5FS_EXTENT_MAX_DEPTH + 1];
+	struct lab5fs_extent_header *hdr;
+	struct lab5fs_extent *ext;
+	unsigned long start, len, phys;
+	int depth, count, pos, err;
+
+	lab5fs_extent_cache_drop(ino);
+
+	depth = ext_find_path(ino, lblk, path);
+	if (depth < 0)
+		return depth;
+	hdr = path[depth].p_hdr;
+	pos = path[depth].p_pos;
+	if (pos < 0)
+		goto out;
+	ext = EXT_FIRST(hdr);
+	start = le32_to_cpu(ext[pos].e_logical);
+	len = le32_to_cpu(ext[pos].e_len);
+	if (lblk >= start + len)
+		goto out;
+
+	if (lblk > start && lblk + 1 < start + len &&
+	    le16_to_cpu(hdr->eh_count) == le16_to_cpu(hdr->eh_max)) {
+		ext_release_path(path);
+		if ((err = ext_make_room(ino, lblk)))
+			return err;
+		depth = ext_find_path(ino, lblk, path);
+		if (depth < 0)
+			return depth;
+		hdr = path[depth].p_hdr;
+		pos = path[depth].p_pos;
+		ext = EXT_FIRST(hdr);
+	}
+	count = le16_to_cpu(hdr->eh_count);
+	phys = le32_to_cpu(ext[pos].e_physical);
+
+	if (len == 1) {
+		memmove(ext + pos, ext + pos + 1,
+			(count - pos - 1) * sizeof(struct lab5fs_extent));
+		hdr->eh_count = cpu_to_le16(count - 1);
+	} else if (lblk == start) {
+		ext[pos].e_logical = cpu_to_le32(start + 1);
+		ext[pos].e_physical = cpu_to_le32(phys + 1);
+		ext[pos].e_len = cpu_to_le32(len - 1);
+	} else if (lblk + 1 == start + len) {
+		ext[pos].e_len = cpu_to_le32(len - 1);
+	} else {
+		/* the tail after lblk becomes an extent of its own. */
+		memmove(ext + pos + 2, ext + pos + 1,
+			(count - pos - 1) * sizeof(struct lab5fs_extent));
+		ext[pos].e_len = cpu_to_le32(lblk - start);
+		ext[pos + 1].e_logical = cpu_to_le32(lblk + 1);
+		ext[pos + 1].e_physical = cpu_to_le32(phys + lblk - start + 1);
+		ext[pos + 1].e_len = cpu_to_le32(start + len - lblk - 1);
+		hdr->eh_count = cpu_to_le16(count + 1);
+	}
+	ext_dirty(ino, &path[depth]);
+	lab5fs_release_block_num(ino->i_sb, phys + lblk - start);
+	ino->i_blocks--;
+	mark_inode_dirty(ino);
+
+  out:
+	ext_release_path(path);
+	return 0;
+}
+
+/*
+ * Remove every mapping at or past logical block first from the subtree
+ * under hdr, freeing data runs and emptied extent blocks. Runs are freed
+ * from their end, one group's worth of blocks at a time. With restart
+ * set, this stops with -EAGAIN once the handle has too few credits left
+ * for another such step, leaving a smaller but consistent tree.
+ * @return 0 on success, a negative error code on failure.
+ */
+static int ext_truncate_node(struct inode *ino,
+			     struct lab5fs_extent_header *hdr,
+			     unsigned long first, int restart)
+{
+	struct super_block *sb = ino->i_sb;
+	struct lab5fs_extent *ext = EXT_FIRST(hdr);
+	struct lab5fs_extent_idx *idx = EXT_IDX_FIRST(hdr);
+	struct buffer_head *bh;
+	int count = le16_to_cpu(hdr->eh_count);
+	unsigned long start, len, phys, child, keep, n;
+	int err = 0;
+
+	if (le16_to_cpu(hdr->eh_depth) == 0) {
+		while (count > 0) {
+			start = le32_to_cpu(ext[count - 1].e_logical);
+			len = le32_to_cpu(ext[count - 1].e_len);
+			phys = le32_to_cpu(ext[count - 1].e_physical);
+			if (start + len <= first)
+				break;
+			if (restart &&
+			    lab5fs_journal_credits(sb) < LAB5FS_TRUNCATE_RESERVE) {
+				err = -EAGAIN;
+				break;
+			}
+
+			/* the head of a run that straddles the cut stays. */
+			keep = start >= first ? 0 : first - start;
+			n = (phys + len - 1) % LAB5FS_BLOCKS_PER_GROUP + 1;
+			if (n > len - keep)
+				n = len - keep;
+			lab5fs_release_block_range(sb, phys + len - n, n);
+			ino->i_blocks -= n;
+			if (len == n)
+				count--;
+			else
+				ext[count - 1].e_len = cpu_to_le32(len - n);
+		}
+		hdr->eh_count = cpu_to_le16(count);
+		return err;
+	}
+
+	while (count > 0) {
+		child = le32_to_cpu(idx[count - 1].ei_block);
+		if (!(bh = sb_bread(sb, child))) {
+			printk("unable to read extent block %lu.\n", child);
+			err = -EIO;
+			break;
+		}
+		if (le16_to_cpu(EXT_HDR(bh)->eh_magic) != LAB5FS_EXTENT_MAGIC) {
+			printk("bad extent block %lu in inode %lu\n",
+			       child, ino->i_ino);
+			brelse(bh);
+			err = -EIO;
+			break;
+		}
+
+		err = ext_truncate_node(ino, EXT_HDR(bh), first, restart);
+		if (err) {
+			lab5fs_journal_dirty(ino->i_sb, ino, bh);
+			brelse(bh);
+			break;
+		}
+
+		/* a child that still maps blocks holds the last ones we keep. */
+		if (le16_to_cpu(EXT_HDR(bh)->eh_count) > 0) {
+			lab5fs_journal_dirty(ino->i_sb, ino, bh);
+			brelse(bh);
+			break;
+		}
+
+		bforget(bh);
+		lab5fs_release_block_num(sb, child);
+		ino->i_blocks--;
+		count--;
+	}
+	hdr->eh_count = cpu_to_le16(count);
+	return err;
+}
+
+/*
+ * Free every block of the file from logical block first on, whole runs
+ * at a time. With restart set the caller's handle was started with
+ * LAB5FS_TRUNCATE_CREDITS, and a file too big or fragmented to free in
+ * one transaction is freed in several, the way ext3 restarts truncate:
+ * when the handle runs low the inode goes on the orphan list, so that a
+ * crash leaves the rest to the next mount, and the handle is restarted
+ * with i_map_sem dropped. The caller takes the inode off the list again.
+ * Without restart everything must fit in the caller's handle.
+ * @return 0 on success, a negative error code on failure.
+ */
+int lab5fs_extent_truncate(struct inode *ino, unsigned long first, int restart)
+{
+	struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+	struct lab5fs_extent_header *root = ext_root(ino);
+	int err;
+
+	for (;;) {
+		lab5fs_extent_cache_drop(ino);
+		err = ext_truncate_node(ino, root, first, restart);
+
+		/* an index root with no children left goes back to an empty leaf. */
+		if (le16_to_cpu(root->eh_depth) > 0 && le16_to_cpu(root->eh_count) == 0)
+			lab5fs_extent_init_root(ino);
+
+		mark_inode_dirty(ino);
+		if (err != -EAGAIN)
+			return err;
+
+		up(&inode_info->i_map_sem);
+		if (!(inode_info->i_flags & LAB5FS_ORPHAN_FL))
+			lab5fs_orphan_insert(ino);
+		err = lab5fs_journal_restart(ino->i_sb, LAB5FS_TRUNCATE_CREDITS);
+		down(&inode_info->i_map_sem);
+		if (err)
+			return err;
+	}
+}
@@ -0,0 +1,16 @@
+#ifndef LAB5FS_EXTENT_H
+#define LAB5FS_EXTENT_H
+
+#include <linux/fs.h>
+
+/*
+ * Extent tree utilities. The caller must hold the inode's i_map_sem.
+ */
+void lab5fs_extent_init_root(struct inode *); //sets up an empty extent tree
+void lab5fs_extent_cache_drop(struct inode *); //forgets cached translations
+int lab5fs_extent_map(struct inode *, unsigned long, unsigned long *, unsigned long *); //logical to physical block
+int lab5fs_extent_insert(struct inode *, unsigned long, unsigned long, unsigned long); //maps a run of blocks
+int lab5fs_extent_truncate(struct inode *, unsigned long, int); //frees every block from the given logical block on, restarting the handle if allowed
+int lab5fs_extent_punch(struct inode *, unsigned long); //unmaps and frees a single block
+
+#endif /* LAB5FS_EXTENT_H */
@@ -6,9 +6,85 @@
 #include <linux/slab.h>
 #include <linux/types.h>
 #include <linux/statfs.h>
+#include <linux/pagemap.h>
+#include <linux/mpage.h>
 #include "lab5fs.h"
 #include "lab5fs_super.h"
 #include "lab5fs_inode.h"
+#include "lab5fs_extent.h"
+#include "lab5fs_dir.h"
+#include "lab5fs_stats.h"
+#include "lab5fs_journal.h"
+
+static int lab5fs_readpage(struct file *file, struct page *page);
+static int lab5fs_readpages(struct file *file, struct address_space *mapping,
+                            struct list_head *pages, unsigned nr_pages);
+static int lab5fs_writepage(struct page *page, struct writeback_control *wbc);
+static int lab5fs_prepare_write(struct file *file, struct page *page,
+                                unsigned from, unsigned to);
+static int lab5fs_commit_write(struct file *file, struct page *page,
+                               unsigned from, unsigned to);
+static sector_t lab5fs_bmap(struct address_space *mapping, sector_t block);
+static ssize_t lab5fs_direct_IO(int rw, struct kiocb *iocb, const struct iovec *iov,
+                                loff_t offset, unsigned long nr_segs);
+static int lab5fs_file_mmap(struct file *file, struct vm_area_struct *vma);
+static int lab5fs_page_mkwrite(struct vm_area_struct *vma, struct page *page);
+static int lab5fs_writepages(struct address_space *mapping,
+                             struct writeback_control *wbc);
+static void lab5fs_invalidatepage(struct page *page, unsigned long offset);
+
+/* b_blocknr of a delayed buffer; no block device has a buffer cached there */
+#define LAB5FS_DELAYED_BLOCK ((sector_t)~0UL)
+
+/*
+ * Inodes come from a dedicated slab holding struct lab5fs_inode_info with
+ * the VFS inode embedded, so the private part needs no allocation of its
+ * own. Fields set up by the constructor survive while objects are reused.
+ */
+static kmem_cache_t *lab5fs_inode_cachep;
+
+struct inode *lab5fs_alloc_inode(struct super_block *sb)
+{
+        struct lab5fs_inode_info *inode_info;
+
+        inode_info = kmem_cache_alloc(lab5fs_inode_cachep, SLAB_KERNEL);
+        if (!inode_info)
+                return NULL;
+        return &inode_info->vfs_inode;
+}
+
+void lab5fs_destroy_inode(struct inode *ino)
+{
+        kmem_cache_free(lab5fs_inode_cachep, LAB5FS_INODE_INFO(ino));
+}
+
+static void lab5fs_init_once(void *obj, kmem_cache_t *cachep, unsigned long flags)
+{
+        struct lab5fs_inode_info *inode_info = obj;
+
+        if ((flags & (SLAB_CTOR_VERIFY|SLAB_CTOR_CONSTRUCTOR)) ==
+            SLAB_CTOR_CONSTRUCTOR) {
+                init_MUTEX(&inode_info->i_map_sem);
+                inode_init_once(&inode_info->vfs_inode);
+        }
+}
+
+int lab5fs_init_inodecache(void)
+{
+        lab5fs_inode_cachep = kmem_cache_create("lab5fs_inode_cache",
+                                                sizeof(struct lab5fs_inode_info),
+                                                0, SLAB_RECLAIM_ACCOUNT,
+                                                lab5fs_init_once, NULL);
+        if (lab5fs_inode_cachep == NULL)
+                return -ENOMEM;
+        return 0;
+}
+
+void lab5fs_destroy_inodecache(void)
+{
+        if (kmem_cache_destroy(lab5fs_inode_cachep))
+                printk("lab5fs_inode_cache: not all structures were freed\n");
+}
 
 /* inode operations go here*/
 struct inode_operations lab5fs_inode_ops = {
@@ -17,62 +93,107 @@ struct inode_operations lab5fs_inode_ops = {
 	unlink: lab5fs_inode_unlink,
 };
 
+/* inode operations of regular files */
+struct inode_operations lab5fs_file_inode_ops = {
+	truncate: lab5fs_truncate,
+	setattr:  lab5fs_setattr,
+};
+
 /* file operations go here*/
 struct file_operations lab5fs_file_ops = {
-	//llseek:generic_file_llseek,
-	//read:  generic_file_read,
-	//write: generic_file_write,
-	//mmap:  generic_file_mmap,
-	//open:  generic_file_open,
+	llseek:   generic_file_llseek,
+	read:     generic_file_read,
+	write:    generic_file_write,
+	mmap:     lab5fs_file_mmap,
+	open:     generic_file_open,
+	sendfile: generic_file_sendfile,
+	fsync:    lab5fs_fsync,
+};
+
+/* page faults on mapped files; the first write to a page goes through page_mkwrite */
+static struct vm_operations_struct lab5fs_file_vm_ops = {
+	nopage:       filemap_nopage,
+	populate:     filemap_populate,
+	page_mkwrite: lab5fs_page_mkwrite,
 };
 
 /* dir operations go her */
 struct file_operations lab5fs_dir_ops = {
 	readdir: lab5fs_readdir,
+	fsync:   lab5fs_fsync,
 };
 
 /* address operations go here*/
 struct address_space_operations lab5fs_address_ops = {
+	readpage:      lab5fs_readpage,
+	readpages:     lab5fs_readpages,
+	writepage:     lab5fs_writepage,
+	writepages:    lab5fs_writepages,
+	sync_page:     block_sync_page,
+	prepare_write: lab5fs_prepare_write,
+	commit_write:  lab5fs_commit_write,
+	bmap:          lab5fs_bmap,
+	direct_IO:     lab5fs_direct_IO,
+	invalidatepage: lab5fs_invalidatepage,
 };
 
-/*Read inode data from a block on disk and fill out a VFS inode*/
-int lab5fs_inode_read_ino(struct inode *ino, unsigned long block_num){
+/* pick the operation tables matching the type of the given inode */
+static void lab5fs_set_ops(struct inode *ino)
+{
+        if (S_ISREG(ino->i_mode)) {
+                ino->i_op = &lab5fs_file_inode_ops;
+                ino->i_fop = &lab5fs_file_ops;
+        } else {
+                ino->i_op = &lab5fs_inode_ops;
+                ino->i_fop = &lab5fs_dir_ops;
+        }
+        ino->i_mapping->a_ops = &lab5fs_address_ops;
+}
+
+/*Read inode data from its slot in an inode table block and fill out a VFS inode*/
+int lab5fs_inode_read_ino(struct inode *ino, unsigned long block_num,
+                          unsigned long offset){
 
-        int err = -ENOMEM;
+        int err = -EIO;
         struct super_block *sb = ino->i_sb;
         struct buffer_head *ibh = NULL;
         struct lab5fs_inode *lab5fs_ino = NULL;
-        unsigned long bi_block_num = 0;
         struct lab5fs_inode_info *inode_meta = NULL;
 
 
-        printk("lab5fs_inode_read_ino:: Reading inode %ld\n", ino->i_ino);
+        lab5fs_dbg("lab5fs_inode_read_ino:: Reading inode %ld\n", ino->i_ino);
 
         /* read the inode's block from disk. */
         if (!(ibh = sb_bread(sb,block_num))) {
                 printk("Unable to read inode block %lu.\n", block_num);
                 goto ret_err;
         }
-        lab5fs_ino = (struct lab5fs_inode *)((char *)(ibh->b_data));
+        lab5fs_ino = (struct lab5fs_inode *)((char *)(ibh->b_data) + offset);
 
-        bi_block_num = le32_to_cpu(lab5fs_ino->i_data_index_block_num);
-
-        printk("Inode %ld, block_index_num=%lu\n",
-                             ino->i_ino, bi_block_num);
-
-        /* initialize the inode's meta data. */
-        inode_meta = kmalloc(sizeof(struct lab5fs_inode_info),GFP_KERNEL);
-        if (inode_meta==NULL) {
-                printk("Not enough memory to allocate inode meta struct.\n");
+        if (le16_to_cpu(lab5fs_ino->i_eh.eh_magic) != LAB5FS_EXTENT_MAGIC) {
+                printk("Inode %ld has no valid extent tree\n", ino->i_ino);
+                err = -EIO;
                 goto ret_err;
         }
-        inode_meta->i_block_num = block_num;
-        inode_meta->i_bi_block_num = bi_block_num;
+
+        /* initialize the inode's meta data. */
+        inode_meta = LAB5FS_INODE_INFO(ino);
+        memcpy(&inode_meta->i_eh, &lab5fs_ino->i_eh, sizeof(inode_meta->i_eh));
+        memcpy(inode_meta->i_extents, lab5fs_ino->i_extents,
+               sizeof(inode_meta->i_extents));
+        inode_meta->i_flags = le32_to_cpu(lab5fs_ino->i_flags);
+        memcpy(inode_meta->i_inline, lab5fs_ino->i_inline,
+               sizeof(inode_meta->i_inline));
+        inode_meta->i_next_orphan = le32_to_cpu(lab5fs_ino->i_next_orphan);
+        memset(inode_meta->i_ext_cache, 0, sizeof(inode_meta->i_ext_cache));
+        inode_meta->i_ext_cache_next = 0;
+        inode_meta->i_ext_leaf = 0;
 
 	/* fill out VFS inode*/
         ino->i_mode = le16_to_cpu(lab5fs_ino->i_mode);
         ino->i_nlink = le16_to_cpu(lab5fs_ino->i_link_count);
-        ino->i_size = le32_to_cpu(lab5fs_ino->i_size);
+        ino->i_size = le32_to_cpu(lab5fs_ino->i_size) |
+                      ((loff_t)le32_to_cpu(lab5fs_ino->i_size_high) << 32);
         ino->i_blksize = LAB5FS_BLOCK_SIZE;
         ino->i_blkbits = LAB5FS_BITS;
         ino->i_blocks = le32_to_cpu(lab5fs_ino->i_num_blocks);
@@ -81,19 +202,15 @@ int lab5fs_inode_read_ino(struct inode *ino, unsigned long block_num){
         ino->i_atime.tv_sec = le32_to_cpu(lab5fs_ino->i_atime);
         ino->i_mtime.tv_sec = le32_to_cpu(lab5fs_ino->i_mtime);
         ino->i_ctime.tv_sec = le32_to_cpu(lab5fs_ino->i_ctime);
-        ino->u.generic_ip = inode_meta;
 
         /* set the inode operations structs  */
-        ino->i_op = &lab5fs_inode_ops;
-        /* TODO: switch based on type */
-        /* ino->i_fop = &lab5fs_file_ops; */
-        ino->i_fop = &lab5fs_dir_ops;
-        ino->i_mapping->a_ops = &lab5fs_address_ops;
+        lab5fs_set_ops(ino);
 
-        printk(    "Inode %ld: i_mode=%o, i_nlink=%d, "
+        lab5fs_dbg(    "Inode %ld: i_mode=%o, i_nlink=%d, "
                    "i_uid=%d, i_gid=%d\n",
                    ino->i_ino, ino->i_mode, ino->i_nlink,
                    ino->i_uid, ino->i_gid);
+        brelse(ibh);
 	return 0;
 
 ret_err:
@@ -105,28 +222,40 @@ ret_err:
 
 /*
  * Update the on-disk copy of the given inode, based given VFS inode struct.
+ * If sync is set, wait for the inode table block to reach the disk; with a
+ * journal, callers commit instead.
  * @return 0 on success, a negative error code on failure.
  */
-int lab5fs_inode_write_ino (struct inode *ino)
+int lab5fs_inode_write_ino (struct inode *ino, int sync)
 {
         int err = 0;
         struct super_block *sb = ino->i_sb;
         int ino_num = le32_to_cpu(ino->i_ino);
         struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
-        int inode_block_num = inode_info->i_block_num;
+        unsigned long inode_block_num, offset = 0;
         struct buffer_head *ibh = NULL;
         struct lab5fs_inode *lab5fs_inode = NULL;
 
-        printk("lab5fs_inode_write_ino:: writing inode %d\n", ino_num);
+        lab5fs_dbg("lab5fs_inode_write_ino:: writing inode %d\n", ino_num);
+
+        inode_block_num = lab5fs_inode_block(sb, ino->i_ino, &offset);
+        if (inode_block_num == 0) {
+                err = -EIO;
+                goto ret;
+        }
 
-        /* load the inode's block. */
+        /* load the inode table block; it is shared with the neighbouring inodes. */
         if (!(ibh = sb_bread(sb, inode_block_num))) {
-                printk("unable to read block %d.\n", inode_block_num);
+                printk("unable to read block %lu.\n", inode_block_num);
                 err = -EIO;
                 goto ret;
         }
 
-        lab5fs_inode = (struct lab5fs_inode*)(ibh->b_data);
+        lab5fs_inode = (struct lab5fs_inode*)(ibh->b_data + offset);
+
+        /* the slot may hold stale bytes from a previously freed inode. */
+        lock_buffer(ibh);
+        memset(lab5fs_inode, 0, LAB5FS_INODE_SIZE);
 
         /* copy data from the VFS's inode to the on-disk inode. */
         lab5fs_inode->i_mode = cpu_to_le16(ino->i_mode);
@@ -138,12 +267,19 @@ int lab5fs_inode_write_ino (struct inode *ino)
         lab5fs_inode->i_ctime = cpu_to_le32(ino->i_ctime.tv_sec);
         lab5fs_inode->i_num_blocks = cpu_to_le32(ino->i_blocks);
         lab5fs_inode->i_size = cpu_to_le32(ino->i_size);
-		/*technically these two below don't matter*/
-        lab5fs_inode->i_data_index_block_num = cpu_to_le32(inode_info->i_bi_block_num);
-		lab5fs_inode->i_block_num = cpu_to_le32(inode_block_num);
-		
-        mark_buffer_dirty(ibh);
-
+        lab5fs_inode->i_size_high = cpu_to_le32(ino->i_size >> 32);
+        memcpy(&lab5fs_inode->i_eh, &inode_info->i_eh, sizeof(inode_info->i_eh));
+        memcpy(lab5fs_inode->i_extents, inode_info->i_extents,
+               sizeof(inode_info->i_extents));
+        lab5fs_inode->i_flags = cpu_to_le32(inode_info->i_flags);
+        memcpy(lab5fs_inode->i_inline, inode_info->i_inline,
+               sizeof(inode_info->i_inline));
+        lab5fs_inode->i_next_orphan = cpu_to_le32(inode_info->i_next_orphan);
+        unlock_buffer(ibh);
+
+        lab5fs_journal_dirty(sb, NULL, ibh);
+        if (sync)
+                err = sync_dirty_buffer(ibh);
 
   ret:
         if (ibh)
@@ -151,449 +287,992 @@ int lab5fs_inode_write_ino (struct inode *ino)
         return err;
 }
 
-/*Free memory used by VFS inode object*/
-void lab5fs_inode_clear(struct inode *ino){
-	struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
-	kfree(inode_info);
-	ino->u.generic_ip = NULL;
-}
-
-/*Clear out data and data index blocks of given inode*/
+/*Free the data blocks and extent blocks of given inode*/
 void lab5fs_inode_clear_blocks(struct inode *ino){
-	struct super_block *sb = ino->i_sb;
 	struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
-	int bi_block_num = inode_info->i_bi_block_num;
-	struct buffer_head *bibh = NULL;
-	struct lab5fs_inode_data_index *block_index_table = NULL;
-	int i, block_num;
-	printk("inode_clear_blocks:: freeing data blocks \n");
-	
-	/* read the inode's block index. */
-	if (!(bibh = sb_bread(sb, bi_block_num))) {
-			printk("unable to read block index, block %d.\n",bi_block_num);
-	}
-	block_index_table = (struct lab5fs_inode_data_index *) bibh->b_data;
-	for (i=0;i < LAB5FS_MAX_BLOCK_INDEX; i++) {
-		block_num = le32_to_cpu(block_index_table->blocks[i]);
-		if (block_num != 0) { //block is in used
-			printk("freeing block %u\n",block_num);
-			lab5fs_release_block_num(sb, block_num);
-		}
-	}
+	lab5fs_dbg("inode_clear_blocks:: freeing data blocks \n");
+
+	down(&inode_info->i_map_sem);
+	lab5fs_extent_truncate(ino, 0, 1);
+	up(&inode_info->i_map_sem);
 	ino->i_blocks=0;
 }
-/*release block and inode numbers held by given inode*/
+/*release the inode number held by given inode; its inode table slot goes with it*/
 void lab5fs_inode_free_inode(struct inode *ino){
 	struct super_block *sb = ino->i_sb;
-	struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
-	long inode_block_num = lab5fs_find_block_num(ino);
-	int bi_block_num = inode_info->i_bi_block_num;
-	
-	lab5fs_release_inode_num(sb, ino->i_ino);
-	lab5fs_release_block_num(sb, inode_block_num);
-	lab5fs_release_block_num(sb, bi_block_num);
 
+	lab5fs_release_inode_num(sb, ino->i_ino);
 }
 
-/*grabs the block number of the first data block from a give data block index*/
-int lab5fs_getblock(struct inode *dir, int *blocknum) {
-	int err = 0;
-	struct super_block *sb = dir->i_sb;
-	struct buffer_head *bh = NULL;
-	struct lab5fs_inode_info *info = LAB5FS_INODE_INFO(dir);
-	struct lab5fs_inode_data_index *data;
+/*
+ * Move the contents of an inline file into a newly allocated block 0 and
+ * switch the inode to block mapping. The block is written synchronously:
+ * the page cache will read it back through the file's own mapping, not
+ * through this buffer. The caller holds i_map_sem.
+ * @return 0 on success, a negative error code on failure.
+ */
+static int lab5fs_inline_to_blocks(struct inode *ino)
+{
+        struct super_block *sb = ino->i_sb;
+        struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+        struct buffer_head *bh;
+        unsigned long size = ino->i_size;
+        int block_num, count = 1, err;
+
+        lab5fs_dbg("inode %lu outgrew its inline data\n", ino->i_ino);
+
+        if (size > LAB5FS_INLINE_SIZE)
+                size = LAB5FS_INLINE_SIZE;
+
+        if (size > 0) {
+                block_num = lab5fs_new_blocks(sb, 0, &count);
+                if (block_num == 0)
+                        return -ENOSPC;
+
+                if (!(bh = sb_getblk(sb, block_num))) {
+                        lab5fs_release_block_num(sb, block_num);
+                        return -EIO;
+                }
+                lock_buffer(bh);
+                memset(bh->b_data, 0, LAB5FS_BLOCK_SIZE);
+                memcpy(bh->b_data, inode_info->i_inline, size);
+                set_buffer_uptodate(bh);
+                unlock_buffer(bh);
+                mark_buffer_dirty(bh);
+                err = sync_dirty_buffer(bh);
+                brelse(bh);
+                if (!err)
+                        err = lab5fs_extent_insert(ino, 0, block_num, 1);
+                if (err) {
+                        lab5fs_release_block_num(sb, block_num);
+                        return err;
+                }
+                ino->i_blocks++;
+        }
+
+        inode_info->i_flags &= ~LAB5FS_INLINE_DATA_FL;
+        memset(inode_info->i_inline, 0, sizeof(inode_info->i_inline));
+        mark_inode_dirty(ino);
+        return 0;
+}
 
-	bh = sb_bread(sb, info->i_bi_block_num);
-	data = (struct lab5fs_inode_data_index *)(bh->b_data);
-	*blocknum = le32_to_cpu(data->blocks[0]);
-	printk("lab5fs:getblock retrieved data block %d from block index %d\n",*blocknum,(int)info->i_bi_block_num);
+/*
+ * Where to look for a new block for logical block iblock: right after the
+ * block before it, so the extent grows in place. The caller holds
+ * i_map_sem.
+ */
+static unsigned long lab5fs_block_goal(struct inode *ino, unsigned long iblock)
+{
+        unsigned long goal = 0, len;
 
-	if(bh)
-		brelse(bh);
-	return err;
+        if (iblock > 0 &&
+            lab5fs_extent_map(ino, iblock - 1, &goal, &len) == 0 && goal != 0)
+                return goal + 1;
+        return 0;
 }
 
-/*Find the inode number of the file specified by char *name */
-int lab5fs_getfile(struct inode *dir, const char *name, int len, ino_t *ino) {
-	int err = 0;
-	struct super_block *sb = dir->i_sb;
-	struct buffer_head *bh = NULL;
-	struct lab5fs_dir *drec = NULL;
-	int blocknum;
-	*ino=0;
-	printk("lab5fs_getfile:: name: %s, len: %d\n", name, len);
-	err = lab5fs_getblock(dir, &blocknum);
-	if(!err) {
-		printk("lab5fs_getfile file block: %d\n",blocknum);
-		bh = sb_bread(sb, blocknum);
-		drec = (struct lab5fs_dir*)bh->b_data;
-		while((char *)drec < (char *)(bh->b_data)+LAB5FS_BLOCK_SIZE){
-			if(drec->dir_inode!=0){ /*empty record*/
-				if(drec->dir_name_len==len){
-					if(memcmp(drec->dir_name, name, len)==0){
-						*ino = drec->dir_inode;
-					}
-				}	
-			}
-			drec++;
-		}
-	}
+/*
+ * Map logical block iblock of the given inode to a disk block through its
+ * extent tree. If create is set and the block is not mapped yet, a new block
+ * is allocated and added to the tree; an inline file is moved out to
+ * blocks first.
+ * Callers that can use more than one block (direct I/O, mpage) ask for up
+ * to bh_result->b_size bytes; b_size is cut down to the run of blocks that
+ * is contiguous on disk, or to the length of the hole. A hole being filled
+ * gets one contiguous run of new blocks.
+ * A delayed buffer (see lab5fs_get_block_delay) always gets its block, as
+ * only writeback and block_truncate_page ask to map one.
+ * With ordered set bh_result belongs to a page, and if it gets a new block
+ * the commit writes it first (lab5fs_journal_dirty_data).
+ * @return 0 on success, a negative error code on failure.
+ */
+static int lab5fs_map_blocks(struct inode *ino, sector_t iblock,
+                             struct buffer_head *bh_result, int create,
+                             int ordered)
+{
+        int err = 0;
+        struct super_block *sb = ino->i_sb;
+        struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+        unsigned long block_num = 0, len = 0, max_blocks;
+        int count;
+        struct lab5fs_handle handle;
+
+        if (iblock >= LAB5FS_MAX_BLOCK_INDEX) {
+                printk("block %lu of inode %lu is past the maximum file size\n",
+                       (unsigned long)iblock, ino->i_ino);
+                return -EFBIG;
+        }
+
+        max_blocks = bh_result->b_size >> LAB5FS_BITS;
+        if (max_blocks == 0)
+                max_blocks = 1;
+        if (max_blocks > LAB5FS_MAX_BLOCK_INDEX - iblock)
+                max_blocks = LAB5FS_MAX_BLOCK_INDEX - iblock;
+        if (buffer_delay(bh_result))
+                create = 1;
+
+        /* an allocation must be journaled as a whole. */
+        if (create)
+                lab5fs_journal_start(sb, &handle, LAB5FS_WRITE_CREDITS);
+        down(&inode_info->i_map_sem);
+
+        if (LAB5FS_INODE_INLINE(ino)) {
+                if (!create)
+                        goto ret;
+                err = lab5fs_inline_to_blocks(ino);
+                if (err)
+                        goto ret;
+        }
+
+        err = lab5fs_extent_map(ino, iblock, &block_num, &len);
+        if (err)
+                goto ret;
+        if (len > max_blocks)
+                len = max_blocks;
+        if (block_num != 0) {
+                map_bh(bh_result, sb, block_num);
+                bh_result->b_size = len << LAB5FS_BITS;
+                goto ret;
+        }
+
+        /* a hole - leave bh_result unmapped unless we were asked to fill it. */
+        if (!create) {
+                bh_result->b_size = len << LAB5FS_BITS;
+                goto ret;
+        }
+
+        count = len;
+        block_num = lab5fs_new_blocks(sb, lab5fs_block_goal(ino, iblock), &count);
+        if (block_num == 0) {
+                err = -ENOSPC;
+                goto ret;
+        }
+
+        err = lab5fs_extent_insert(ino, iblock, block_num, count);
+        if (err) {
+                lab5fs_release_block_range(sb, block_num, count);
+                goto ret;
+        }
+        ino->i_blocks += count;
+        mark_inode_dirty(ino);
 
+        set_buffer_new(bh_result);
+        map_bh(bh_result, sb, block_num);
+        bh_result->b_size = count << LAB5FS_BITS;
+        if (ordered)
+                lab5fs_journal_dirty_data(sb, bh_result);
 
-	if(bh)
-		brelse(bh);
-	return err;
+  ret:
+        /* a delayed buffer's reservation ends once it has a block. */
+        if (!err && buffer_delay(bh_result) && buffer_mapped(bh_result)) {
+                clear_buffer_delay(bh_result);
+                lab5fs_release_reservation(sb, 1);
+        }
+        up(&inode_info->i_map_sem);
+        if (create)
+                lab5fs_journal_stop(&handle);
+        return err;
 }
 
-/* Needed for ls. Fill out a VFS inode corresponding to the filename give by the dentry*/
-struct dentry* lab5fs_lookup(struct inode *dir, struct dentry *dentry, struct nameidata *data) {
-	int err = 0;
-	struct inode *inode = NULL;
-	ino_t ino;
+int lab5fs_get_block(struct inode *ino, sector_t iblock,
+                     struct buffer_head *bh_result, int create)
+{
+        return lab5fs_map_blocks(ino, iblock, bh_result, create, 1);
+}
 
-	printk("lab5fs_lookup:: name: %s, len: %d\n", dentry->d_name.name, dentry->d_name.len);
-	err = lab5fs_getfile(dir, dentry->d_name.name, dentry->d_name.len, &ino);
-	if(!err && ino>0) {
-		printk("lab5fs_lookup: inode %d\n",(int)ino);
-		inode = iget(dir->i_sb, ino);
-	}
-		d_add(dentry, inode);
-	return NULL;
+/*
+ * get_block for direct I/O, whose buffer_head is its own rather than a
+ * page's, so the commit cannot write it. Direct writes allocate only past
+ * the end of the file, and i_size covers the new blocks once their data
+ * is on disk.
+ */
+static int lab5fs_get_block_direct(struct inode *ino, sector_t iblock,
+                                   struct buffer_head *bh_result, int create)
+{
+        return lab5fs_map_blocks(ino, iblock, bh_result, create, 0);
 }
 
-/* List a directory's files */
-int lab5fs_readdir(struct file *filep, void *dirent, filldir_t filldir) {
-	int err = 0;
-	struct dentry *dentry = filep->f_dentry;
-	struct inode *inode = dentry->d_inode;
-	struct super_block *sb = inode->i_sb;
-	struct buffer_head *bh = NULL;
-	struct lab5fs_dir * dir;
-	int block_num=0;
-
-	printk("lab5fs::readdir Reading directory inode=%d file_pos=%d filepath=%s\n",(int)inode->i_ino,(int)filep->f_pos,dentry->d_name.name);
-	
-	/*generate . and .. entries*/
-	if(filep->f_pos == 0) {
-		filldir(dirent, ".", 1, filep->f_pos, inode->i_ino, DT_DIR);
-		filep->f_pos++;
-	}
+/*
+ * get_block for buffered writes and page_mkwrite, which delays
+ * allocation: a hole under the write gets no block yet, only one block
+ * reserved against the free count. Its buffer is marked delayed and left
+ * unmapped, so anything that goes to write it calls get_block with create
+ * set first. Writeback allocates the delayed blocks of many pages at once
+ * (lab5fs_da_alloc_pages), so a file written in one go lands in one
+ * contiguous run, and a file deleted before then never touches the
+ * bitmaps.
+ */
+static int lab5fs_get_block_delay(struct inode *ino, sector_t iblock,
+                                  struct buffer_head *bh_result, int create)
+{
+        int err;
 
-	if(filep->f_pos == 1) {
-		filldir(dirent, "..", 2, filep->f_pos, dentry->d_parent->d_inode->i_ino, DT_DIR);
-		filep->f_pos++;
-	}
+        if (buffer_delay(bh_result))
+                return 0;
+        /* moving an inline file out to blocks allocates right away. */
+        if (!create || LAB5FS_INODE_INLINE(ino))
+                return lab5fs_get_block(ino, iblock, bh_result, create);
 
-	/*look through lab5fs_dir structures in inode data block*/
-	err = lab5fs_getblock(inode, &block_num);
-	if(err){
-		printk("lab5fs readdir could not find data block=%d\n",block_num);
-		goto out;
-	}
-	bh = sb_bread(sb, block_num);
-	if(!bh){
-		printk("error reading directory from disk. block=%d\n",block_num);
-		err=-EIO;
-		goto out;
-	}	
-	dir=(struct lab5fs_dir*)(((char*)(bh->b_data)) + filep->f_pos - 2);
-	printk("readdir inode file size %llu\n",inode->i_size);
-	while(filep->f_pos < LAB5FS_BLOCK_SIZE + 2){ /*check bounds*/
-		if(dir->dir_inode != 0) //skip empty directories indicated by inode==0
-		{
-			if (filldir(dirent, dir->dir_name, dir->dir_name_len, filep->f_pos,le32_to_cpu(dir->dir_inode),DT_UNKNOWN) < 0) {
-				 goto out;
-			}
-			printk("lab5fs readdir adding %s at postion inode=%d\n",dir->dir_name,le32_to_cpu(dir->dir_inode));
-		}
-		 /* skip to the next entry. */
-		filep->f_pos += sizeof(struct lab5fs_dir);
-		dir++;
-	}
-out:
-	if(bh)
-		brelse(bh);
-	return err;
-}
+        err = lab5fs_get_block(ino, iblock, bh_result, 0);
+        if (err || buffer_mapped(bh_result))
+                return err;
 
+        err = lab5fs_reserve_blocks(ino->i_sb, 1);
+        if (err)
+                return err;
+        /* block_prepare_write looks for stale metadata under a new buffer. */
+        bh_result->b_bdev = ino->i_sb->s_bdev;
+        bh_result->b_blocknr = LAB5FS_DELAYED_BLOCK;
+        set_buffer_new(bh_result);
+        set_buffer_delay(bh_result);
+        return 0;
+}
 
 /*
- * Initialize a data index block for specified inode at specified block number
- *
+ * Map the delayed buffers of the locked pages pages[0..nr) that fall in
+ * logical blocks lblk..lblk+count-1 to the blocks allocated for them from
+ * block_num on. Called inside the allocating handle, so that the commit
+ * of the allocation writes their data first.
  */
-int lab5fs_inode_init_block_index(struct inode *ino, int bi_block_num)
+static void lab5fs_da_map_run(struct inode *ino, struct page **pages, int nr,
+                              unsigned long lblk, unsigned long block_num,
+                              unsigned long count)
 {
-        int err = 0;
         struct super_block *sb = ino->i_sb;
-        struct buffer_head *bibh = NULL;
-        struct lab5fs_inode_data_index *lab5fs_data_index = NULL;
-
-        /* read the inode's block index. */
-        if (!(bibh = sb_bread(sb, bi_block_num))) {
-                printk("unable to read inode block index, block %d.\n",
-                       bi_block_num);
-                err = -ENOMEM;
-                goto ret;
+        struct buffer_head *head, *bh;
+        unsigned long iblock;
+        int i;
+
+        for (i = 0; i < nr; i++) {
+                if (!page_has_buffers(pages[i]))
+                        continue;
+                iblock = pages[i]->index << (PAGE_CACHE_SHIFT - LAB5FS_BITS);
+                head = bh = page_buffers(pages[i]);
+                do {
+                        if (!buffer_delay(bh) || iblock < lblk ||
+                            iblock >= lblk + count)
+                                continue;
+                        map_bh(bh, sb, block_num + (iblock - lblk));
+                        unmap_underlying_metadata(bh->b_bdev, bh->b_blocknr);
+                        clear_buffer_delay(bh);
+                        lab5fs_release_reservation(sb, 1);
+                        lab5fs_journal_dirty_data(sb, bh);
+                } while (iblock++, (bh = bh->b_this_page) != head);
         }
-        lab5fs_data_index = (struct lab5fs_inode_data_index *)(bibh->b_data);
-        memset(lab5fs_data_index->blocks, 0, sizeof(*lab5fs_data_index));
-        mark_buffer_dirty(bibh);
+}
 
-  ret:
-        if (bibh)
-                brelse(bibh);
+/*
+ * Allocate the blocks of the delayed run of count blocks at logical block
+ * lblk, with as few calls to the allocator as free space allows, and map
+ * the buffers of pages[0..nr) that the run covers.
+ * @return 0 on success, a negative error code on failure.
+ */
+static int lab5fs_da_alloc_run(struct inode *ino, struct page **pages, int nr,
+                               unsigned long lblk, unsigned long count)
+{
+        struct super_block *sb = ino->i_sb;
+        struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+        struct lab5fs_handle handle;
+        unsigned long block_num;
+        int n, err = 0;
+
+        lab5fs_dbg("inode %lu: allocating %lu delayed blocks at %lu\n",
+                   ino->i_ino, count, lblk);
+        while (count > 0 && !err) {
+                n = count;
+                lab5fs_journal_start(sb, &handle, LAB5FS_WRITE_CREDITS);
+                down(&inode_info->i_map_sem);
+                block_num = lab5fs_new_blocks(sb, lab5fs_block_goal(ino, lblk), &n);
+                if (block_num == 0) {
+                        err = -ENOSPC;
+                } else if ((err = lab5fs_extent_insert(ino, lblk, block_num, n))) {
+                        lab5fs_release_block_range(sb, block_num, n);
+                } else {
+                        ino->i_blocks += n;
+                        mark_inode_dirty(ino);
+                        lab5fs_da_map_run(ino, pages, nr, lblk, block_num, n);
+                        lblk += n;
+                        count -= n;
+                }
+                up(&inode_info->i_map_sem);
+                lab5fs_journal_stop(&handle);
+        }
         return err;
 }
 
 /*
- * Allocate a new inode, to be used when creating a new file or directory.
+ * Allocate the delayed blocks of the locked pages pages[0..nr), which
+ * belong to ino and come in index order. Delayed blocks that follow each
+ * other make one run, which goes to the allocator as a single request.
+ * Buffers left delayed after an error are allocated one at a time by
+ * get_block when their page is written.
+ * @return 0 on success, a negative error code on failure.
  */
-struct inode *lab5fs_inode_new_inode(struct super_block *sb, int mode)
+static int lab5fs_da_alloc_pages(struct inode *ino, struct page **pages, int nr)
 {
-        struct inode *child_ino = NULL;
-        ino_t ino_num = 0;
-        int inode_block_num = 0;
-        int bi_block_num = 0;
-        int err = 0;
-        struct lab5fs_inode_info *inode_info = NULL;
-
-        /* allocate a disk block to contain this inode's data. */
-        inode_block_num = lab5fs_alloc_block_num(sb);
-        if (inode_block_num == 0) {
-                err = -ENOSPC;
-                goto ret_err;
+        struct buffer_head *head, *bh;
+        unsigned long iblock, start = 0, count = 0;
+        int i, err = 0;
+
+        for (i = 0; i < nr && !err; i++) {
+                if (!page_has_buffers(pages[i]))
+                        continue;
+                iblock = pages[i]->index << (PAGE_CACHE_SHIFT - LAB5FS_BITS);
+                head = bh = page_buffers(pages[i]);
+                do {
+                        if (!buffer_delay(bh))
+                                continue;
+                        if (count > 0 && start + count == iblock) {
+                                count++;
+                                continue;
+                        }
+                        if (count > 0 &&
+                            (err = lab5fs_da_alloc_run(ino, pages, nr, start, count)))
+                                break;
+                        start = iblock;
+                        count = 1;
+                } while (iblock++, (bh = bh->b_this_page) != head);
         }
+        if (!err && count > 0)
+                err = lab5fs_da_alloc_run(ino, pages, nr, start, count);
+        return err;
+}
 
-        /* allocate a disk block to contain the block index of this inode. */
-        bi_block_num = lab5fs_alloc_block_num(sb);
-        if (bi_block_num == 0) {
-                err = -ENOSPC;
-                goto ret_err;
-        }
+/* Fill a page of an inline file from i_inline; only page 0 has any data. */
+static void lab5fs_inline_fill_page(struct inode *ino, struct page *page)
+{
+        struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+        unsigned long size = 0;
+        char *kaddr;
 
-        /* allocate a free inode number. */
-        ino_num = lab5fs_alloc_inode_num(sb, inode_block_num);
-        if (ino_num == 0) {
-                err = -ENOSPC;
-                goto ret_err;
+        if (page->index == 0) {
+                size = ino->i_size;
+                if (size > LAB5FS_INLINE_SIZE)
+                        size = LAB5FS_INLINE_SIZE;
         }
 
-        /* allocate a VFS inode object. */
-        child_ino = new_inode(sb);
-        if (!child_ino) {
-                printk("printk: new_inode() failed... inode %lu\n",ino_num);
-                err = -ENOMEM;
-                goto ret_err;
-        }
+        kaddr = kmap_atomic(page, KM_USER0);
+        memcpy(kaddr, inode_info->i_inline, size);
+        memset(kaddr + size, 0, PAGE_CACHE_SIZE - size);
+        flush_dcache_page(page);
+        kunmap_atomic(kaddr, KM_USER0);
+        SetPageUptodate(page);
+}
 
-        /* initialize the inode's block index. */
-        err = lab5fs_inode_init_block_index(child_ino, bi_block_num);
-        if (err)
-                goto ret_err;
+/*
+ * True if every block of the page is a hole. Such a page is read by
+ * zeroing it, without buffers or a trip to the disk.
+ */
+static int lab5fs_page_is_hole(struct inode *ino, struct page *page)
+{
+        struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+        unsigned long iblock, block_num = 0, len = 0;
+        int err;
 
-        /* init the inode's data. */
-        child_ino->i_ino = ino_num;
-        child_ino->i_mode = mode;
-        child_ino->i_nlink = 1;  /* this inode will be stored in a directory,
-                                  * so there's at least one link to this inode,
-                                  * from that directory. */
-        child_ino->i_size = 0;
-        child_ino->i_blksize = LAB5FS_BLOCK_SIZE;
-        child_ino->i_blkbits = 10;
-        child_ino->i_blocks = 0;
-        child_ino->i_uid = current->fsuid;
-        child_ino->i_gid = current->fsgid;
-        child_ino->i_atime = child_ino->i_mtime = child_ino->i_ctime = CURRENT_TIME;
+        if (page_has_buffers(page))
+                return 0;
+        iblock = page->index << (PAGE_CACHE_SHIFT - LAB5FS_BITS);
+        down(&inode_info->i_map_sem);
+        err = lab5fs_extent_map(ino, iblock, &block_num, &len);
+        up(&inode_info->i_map_sem);
+        return !err && block_num == 0 &&
+               len >= (PAGE_CACHE_SIZE >> LAB5FS_BITS);
+}
 
+static int lab5fs_readpage(struct file *file, struct page *page)
+{
+        struct inode *ino = page->mapping->host;
+        char *kaddr;
 
-        /* init the inode's lab5fs metadata. */
-        inode_info = kmalloc(sizeof(struct lab5fs_inode_info),
-                                    GFP_KERNEL);
-        if (!inode_info) {
-                printk("not enough memory to allocate inode meta data.\n");
-                goto ret_err;
+        if (LAB5FS_INODE_INLINE(ino)) {
+                lab5fs_inline_fill_page(ino, page);
+                unlock_page(page);
+                return 0;
         }
-        inode_info->i_block_num = inode_block_num;
-        inode_info->i_bi_block_num = bi_block_num;
-
-        child_ino->u.generic_ip = inode_info;
+        if (lab5fs_page_is_hole(ino, page)) {
+                kaddr = kmap_atomic(page, KM_USER0);
+                memset(kaddr, 0, PAGE_CACHE_SIZE);
+                flush_dcache_page(page);
+                kunmap_atomic(kaddr, KM_USER0);
+                SetPageUptodate(page);
+                unlock_page(page);
+                return 0;
+        }
+        return mpage_readpage(page, lab5fs_get_block);
+}
 
-        /* set the inode operations structs. */
-		child_ino->i_op = &lab5fs_inode_ops;
-		child_ino->i_fop = NULL;
-		child_ino->i_mapping->a_ops = &lab5fs_address_ops;
-        
-		//we are not creating directories
-		//child_ino->i_op = &lab5fs_dir_iops;
-		//child_ino->i_fop = &slab5s_dir_fops;
-		//child_ino->i_mapping->a_ops = &lab5fs_aops;
-        
+static int lab5fs_readpage_filler(void *data, struct page *page)
+{
+        return lab5fs_readpage(data, page);
+}
 
-        insert_inode_hash(child_ino);
-        /* make sure the inode gets written to disk by the inodes cache. */
-        mark_inode_dirty(child_ino);
+/*
+ * Readahead. get_block maps whole runs that are contiguous on disk, so
+ * mpage puts the pages of each run into a single bio instead of reading
+ * block by block through buffer heads. An inline file has nothing on
+ * disk; its pages are filled one by one from the inode.
+ */
+static int lab5fs_readpages(struct file *file, struct address_space *mapping,
+                            struct list_head *pages, unsigned nr_pages)
+{
+        if (LAB5FS_INODE_INLINE(mapping->host))
+                return read_cache_pages(mapping, pages, lab5fs_readpage_filler, file);
+        return mpage_readpages(mapping, pages, nr_pages, lab5fs_get_block);
+}
 
-        /* no errors*/
-        err = 0;
-        goto ret;
+/* True if len bytes at addr are all zero. */
+static int lab5fs_is_zero(const char *addr, unsigned len)
+{
+        const unsigned long *p = (const unsigned long *)addr;
+        unsigned i;
 
-  ret_err:
-        if (child_ino)
-                iput(child_ino); /* child_ino will be deleted here. */
-        if (ino_num > 0)
-                lab5fs_release_inode_num(sb, ino_num);
-        if (inode_block_num > 0)
-                lab5fs_release_block_num(sb, inode_block_num);
-        if (bi_block_num > 0)
-                lab5fs_release_block_num(sb, bi_block_num);
-  ret:
-        return (err == 0 ? child_ino : NULL);
+        for (i = 0; i < len / sizeof(*p); i++)
+                if (p[i])
+                        return 0;
+        return 1;
 }
 
 /*
- * Given a directory's inode and a child inode, write a directory struct to
- * the inode's on disk data
- * @return 0 on success, a negative error code on failure.
+ * With the sparse mount option, give back the blocks of a dirty page
+ * that hold nothing but zeroes instead of writing them, so they read
+ * back from a hole; a delayed block of zeroes just drops its reservation.
+ * The caller holds the page lock.
  */
-int lab5fs_dir_add_link(struct inode *parent_dir, struct inode *child,
-                        const char *name, int namelen)
+static void lab5fs_punch_zero_blocks(struct inode *ino, struct page *page)
 {
-        int err = 0;
-        struct super_block *sb = parent_dir->i_sb;
-        struct buffer_head *data_bh = NULL;
-        struct lab5fs_dir *dir_rec = NULL;
-        int data_block_num = 0;
+        struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+        struct buffer_head *head, *bh;
+        struct lab5fs_handle handle;
+        unsigned long iblock, last_block;
+        int started = 0, err;
+        char *kaddr;
+
+        if (!page_has_buffers(page) || i_size_read(ino) == 0)
+                return;
+        last_block = (i_size_read(ino) - 1) >> LAB5FS_BITS;
+        iblock = page->index << (PAGE_CACHE_SHIFT - LAB5FS_BITS);
+
+        kaddr = kmap(page);
+        head = bh = page_buffers(page);
+        do {
+                if (iblock > last_block)
+                        break;
+                if (buffer_delay(bh) && buffer_dirty(bh) &&
+                    lab5fs_is_zero(kaddr + bh_offset(bh), bh->b_size)) {
+                        clear_buffer_dirty(bh);
+                        clear_buffer_delay(bh);
+                        lab5fs_release_reservation(ino->i_sb, 1);
+                        continue;
+                }
+                if (!buffer_mapped(bh) || !buffer_dirty(bh) ||
+                    !lab5fs_is_zero(kaddr + bh_offset(bh), bh->b_size))
+                        continue;
+                if (!started) {
+                        lab5fs_journal_start(ino->i_sb, &handle, LAB5FS_WRITE_CREDITS);
+                        down(&inode_info->i_map_sem);
+                        started = 1;
+                } else if (lab5fs_journal_credits(ino->i_sb) < LAB5FS_WRITE_CREDITS) {
+                        /* each punch leaves the tree whole, so the ones so
+                         * far may commit on their own. */
+                        up(&inode_info->i_map_sem);
+                        err = lab5fs_journal_restart(ino->i_sb, LAB5FS_WRITE_CREDITS);
+                        down(&inode_info->i_map_sem);
+                        if (err)
+                                break;
+                }
+                if (lab5fs_extent_punch(ino, iblock))
+                        break;
+                /* the buffer stays uptodate, and clean since nothing backs it. */
+                clear_buffer_dirty(bh);
+                clear_buffer_mapped(bh);
+        } while (iblock++, (bh = bh->b_this_page) != head);
+        kunmap(page);
+
+        if (started) {
+                up(&inode_info->i_map_sem);
+                lab5fs_journal_stop(&handle);
+        }
+}
 
+static int lab5fs_writepage(struct page *page, struct writeback_control *wbc)
+{
+        struct inode *ino = page->mapping->host;
+        struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+        unsigned long size;
+        char *kaddr;
+
+        /* commit_write keeps i_inline current, but take the page's
+         * contents in case it was dirtied some other way. */
+        if (LAB5FS_INODE_INLINE(ino)) {
+                if (page->index == 0) {
+                        size = ino->i_size;
+                        if (size > LAB5FS_INLINE_SIZE)
+                                size = LAB5FS_INLINE_SIZE;
+                        kaddr = kmap_atomic(page, KM_USER0);
+                        memcpy(inode_info->i_inline, kaddr, size);
+                        kunmap_atomic(kaddr, KM_USER0);
+                        mark_inode_dirty(ino);
+                }
+                unlock_page(page);
+                return 0;
+        }
+        if (LAB5FS_TEST_OPT(ino->i_sb, SPARSE))
+                lab5fs_punch_zero_blocks(ino, page);
+        /* on failure get_block allocates what is left a block at a time. */
+        lab5fs_da_alloc_pages(ino, &page, 1);
+        return block_write_full_page(page, lab5fs_get_block, wbc);
+}
 
-		printk("Adding link, inode %lu -> inode %lu, name=%s\n",
-                   parent_dir->i_ino, child->i_ino, name);
+/*
+ * Write back the dirty pages of a file. Their delayed blocks are
+ * allocated first, a pagevec of locked pages at a time, each batch
+ * carrying on where the last one ended on disk; without a journal, mpage
+ * then sends every contiguous run out as one bio. With one, each page
+ * goes through writepage and the elevator merges the runs: the commit
+ * writes ordered data through the page's buffers, and mpage must never
+ * find one of those locked. The allocation pass keeps to the pages
+ * this writeback will get to - the range asked for, up to nr_to_write of
+ * them - and, like mpage_writepages, does not wait on pages that are
+ * locked or under writeback unless the caller syncs. Pages it leaves
+ * out are allocated by writepage if mpage does reach them. Inline files,
+ * and the sparse option, which looks for blocks of zeroes, go a page at
+ * a time through writepage.
+ */
+static int lab5fs_writepages(struct address_space *mapping,
+                             struct writeback_control *wbc)
+{
+        struct inode *ino = mapping->host;
+        struct page *pages[PAGEVEC_SIZE], *page;
+        struct pagevec pvec;
+        pgoff_t index, end;
+        long budget = wbc->nr_to_write;
+        int i, nr, locked;
+
+        if (LAB5FS_INODE_INLINE(ino) || LAB5FS_TEST_OPT(ino->i_sb, SPARSE))
+                return mpage_writepages(mapping, wbc, NULL);
+
+        if (wbc->range_cyclic) {
+                index = mapping->writeback_index;
+                end = ~(pgoff_t)0;
+        } else {
+                index = wbc->range_start >> PAGE_CACHE_SHIFT;
+                end = wbc->range_end >> PAGE_CACHE_SHIFT;
+        }
 
-        /* sanity checks. */
-        if (namelen > LAB5FS_MAX_FNAME) {
-                err = -EINVAL;
-                goto ret_err;
+        pagevec_init(&pvec, 0);
+        while (budget > 0 && index <= end &&
+               !(wbc->nonblocking && bdi_write_congested(mapping->backing_dev_info)) &&
+               (nr = pagevec_lookup_tag(&pvec, mapping, &index, PAGECACHE_TAG_DIRTY,
+                                        min(end - index, (pgoff_t)PAGEVEC_SIZE - 1) + 1))) {
+                for (i = 0, locked = 0; i < nr && budget > 0; i++) {
+                        page = pvec.pages[i];
+                        if (page->index > end)
+                                break;
+                        if (wbc->sync_mode == WB_SYNC_NONE) {
+                                if (TestSetPageLocked(page))
+                                        continue;
+                        } else {
+                                lock_page(page);
+                                wait_on_page_writeback(page);
+                        }
+                        if (page->mapping != mapping || !PageDirty(page) ||
+                            PageWriteback(page)) {
+                                unlock_page(page);
+                                continue;
+                        }
+                        pages[locked++] = page;
+                        budget--;
+                }
+                /* writepage retries whatever this leaves delayed. */
+                lab5fs_da_alloc_pages(ino, pages, locked);
+                for (i = 0; i < locked; i++)
+                        unlock_page(pages[i]);
+                pagevec_release(&pvec);
+                cond_resched();
         }
+        if (LAB5FS_SB_INFO(ino->i_sb)->s_journal)
+                return mpage_writepages(mapping, wbc, NULL);
+        return mpage_writepages(mapping, wbc, lab5fs_get_block);
+}
 
-        err = lab5fs_getblock(parent_dir, &data_block_num);
-        if (err)
-                goto ret_err;
+/*
+ * Part or all of a page is leaving the page cache. Delayed buffers past
+ * offset will never be written, so give back their reservations.
+ */
+static void lab5fs_invalidatepage(struct page *page, unsigned long offset)
+{
+        struct buffer_head *head, *bh;
+        unsigned long curr = 0;
+
+        if (!page_has_buffers(page))
+                return;
+        head = bh = page_buffers(page);
+        do {
+                if (curr >= offset && buffer_delay(bh)) {
+                        clear_buffer_delay(bh);
+                        lab5fs_release_reservation(page->mapping->host->i_sb, 1);
+                }
+                curr += bh->b_size;
+        } while ((bh = bh->b_this_page) != head);
+        block_invalidatepage(page, offset);
+}
 
-        /* read in the data block of the parent directory. */
-        printk("Reading directory data in block %d\n", data_block_num);
-        if (!(data_bh = sb_bread(sb, data_block_num))) {
-                printk("unable to read dir data block.\n");
-                err = -EIO;
-                goto ret;
+/* True if a write of page bytes from..to keeps an inline file inline. */
+static int lab5fs_write_fits_inline(struct inode *ino, struct page *page,
+                                    unsigned to)
+{
+        return LAB5FS_INODE_INLINE(ino) && page->index == 0 &&
+               to <= LAB5FS_INLINE_SIZE;
+}
+
+static int lab5fs_prepare_write(struct file *file, struct page *page,
+                                unsigned from, unsigned to)
+{
+        struct inode *ino = page->mapping->host;
+
+        /* small writes to an inline file stay in the inode; anything
+         * larger reaches get_block, which moves the file out to blocks. */
+        if (lab5fs_write_fits_inline(ino, page, to)) {
+                if (!PageUptodate(page))
+                        lab5fs_inline_fill_page(ino, page);
+                return 0;
         }
+        return block_prepare_write(page, from, to, lab5fs_get_block_delay);
+}
 
-        /*insert new directory structure into inode data buffer head*/
-        dir_rec = (struct lab5fs_dir *)((char*)(data_bh->b_data));
-		while((char*) dir_rec < (char*)(data_bh->b_data) + LAB5FS_BLOCK_SIZE){
-			if( dir_rec->dir_inode == 0)
-                break; /* empty entry found. */
-			dir_rec++;
-		}
-		
-        /* if no free entry found... */
-        if (((char*)dir_rec) >= ((char*)data_bh->b_data) + LAB5FS_BLOCK_SIZE) {
-                printk("Out of directory space at block %d\n",data_block_num);
-		err = -ENOSPC;
-                goto ret_err;
+static int lab5fs_commit_write(struct file *file, struct page *page,
+                               unsigned from, unsigned to)
+{
+        struct inode *ino = page->mapping->host;
+        struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+        char *kaddr;
+
+        if (lab5fs_write_fits_inline(ino, page, to)) {
+                /* the inode holds the data, so the page stays clean. */
+                kaddr = kmap_atomic(page, KM_USER0);
+                memcpy(inode_info->i_inline + from, kaddr + from, to - from);
+                kunmap_atomic(kaddr, KM_USER0);
+                if (to > ino->i_size)
+                        i_size_write(ino, to);
+                mark_inode_dirty(ino);
+                return 0;
+        }
+        return generic_commit_write(file, page, from, to);
+}
+
+static sector_t lab5fs_bmap(struct address_space *mapping, sector_t block)
+{
+        /* delayed blocks have no number until written back. */
+        if (mapping_tagged(mapping, PAGECACHE_TAG_DIRTY))
+                filemap_write_and_wait(mapping);
+        return generic_block_bmap(mapping, block, lab5fs_get_block);
+}
+
+/*
+ * O_DIRECT reads and writes go between the user's buffers and the disk
+ * without the page cache. get_block hands back whole contiguous runs, so
+ * each run becomes one large request. Holes read as zeroes; writes into
+ * holes inside the file fall back to the page cache, and writes past the
+ * end allocate as they go.
+ */
+static ssize_t lab5fs_direct_IO(int rw, struct kiocb *iocb, const struct iovec *iov,
+                                loff_t offset, unsigned long nr_segs)
+{
+        struct inode *ino = iocb->ki_filp->f_mapping->host;
+        struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+        struct lab5fs_handle handle;
+        int err = 0;
+
+        /* the data of an inline file has no disk block to go to, so it is
+         * moved out to one first. */
+        if (LAB5FS_INODE_INLINE(ino)) {
+                if (IS_RDONLY(ino))
+                        return -EINVAL;
+                lab5fs_journal_start(ino->i_sb, &handle, LAB5FS_WRITE_CREDITS);
+                down(&inode_info->i_map_sem);
+                if (LAB5FS_INODE_INLINE(ino))
+                        err = lab5fs_inline_to_blocks(ino);
+                up(&inode_info->i_map_sem);
+                lab5fs_journal_stop(&handle);
+                if (err)
+                        return err;
         }
-		
-		/* populate the directory entry. */
-        dir_rec->dir_inode = cpu_to_le32(child->i_ino);
-        dir_rec->dir_name_len = namelen;
-        memcpy(dir_rec->dir_name, name, namelen);
 
-	   
-        mark_buffer_dirty(data_bh);
-	parent_dir->i_size += sizeof(dir_rec);
-        parent_dir->i_mtime = parent_dir->i_ctime = CURRENT_TIME;
-        mark_inode_dirty(parent_dir);
+        return blockdev_direct_IO(rw, iocb, ino, ino->i_sb->s_bdev, iov,
+                                  offset, nr_segs, lab5fs_get_block_direct, NULL);
+}
+
+static int lab5fs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+        int err;
+
+        err = generic_file_mmap(file, vma);
+        if (!err)
+                vma->vm_ops = &lab5fs_file_vm_ops;
+        return err;
+}
+
+/*
+ * A page of a shared writable mapping is about to be made writable.
+ * Reserve a block for every hole under it now, while the fault can still
+ * fail with ENOSPC, rather than leaving writeback to find there is no space.
+ * Returns an error (the task gets SIGBUS) if the page was truncated away.
+ */
+static int lab5fs_page_mkwrite(struct vm_area_struct *vma, struct page *page)
+{
+        struct inode *ino = vma->vm_file->f_dentry->d_inode;
+        loff_t size, pos = (loff_t)page->index << PAGE_CACHE_SHIFT;
+        unsigned end;
+        int err = -EINVAL;
+
+        lock_page(page);
+        size = i_size_read(ino);
+        if (page->mapping != ino->i_mapping || pos >= size)
+                goto ret;
 
-        /* all went well... */
+        /* writepage copies an inline file's page back into the inode. */
         err = 0;
-        goto ret;
+        if (LAB5FS_INODE_INLINE(ino))
+                goto ret;
+
+        end = PAGE_CACHE_SIZE;
+        if (size - pos < PAGE_CACHE_SIZE)
+                end = size - pos;
+        err = block_prepare_write(page, 0, end, lab5fs_get_block_delay);
+        if (!err)
+                err = block_commit_write(page, 0, end);
 
-  ret_err:
-        /* fallthrough */
   ret:
-        if (data_bh)
-                brelse(data_bh);
+        unlock_page(page);
         return err;
 }
 
-
 /*
- * Given a directory's inode and a child inode, remove this child inode from
- * the directory's list-of-entries.
- * @return 0 on success, a negative error code on failure.
+ * Release the data blocks past the new i_size of a regular file.
+ * Called by the VFS (vmtruncate) after i_size has been updated.
  */
-int lab5fs_dir_del_link(struct inode *parent_dir, struct inode *child,
-                        const char *name, int namelen)
+void lab5fs_truncate(struct inode *ino)
 {
-        int err = 0;
-        struct super_block *sb = parent_dir->i_sb;
-        struct buffer_head *data_bh = NULL;
-        struct lab5fs_dir *dir_rec = NULL;
-        int data_block_num = 0;
-        int found_child = 0;
+        struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+        struct lab5fs_handle handle;
+        unsigned long first_block;
+
+        if (!S_ISREG(ino->i_mode))
+                return;
+
+        if (LAB5FS_INODE_INLINE(ino)) {
+                lab5fs_journal_start(ino->i_sb, &handle, LAB5FS_WRITE_CREDITS);
+                down(&inode_info->i_map_sem);
+                /* setattr moves a file it extends past the inode out to
+                 * blocks first; should that still fail here, an inline
+                 * file must not claim more than the inode holds. */
+                if (ino->i_size > LAB5FS_INLINE_SIZE &&
+                    lab5fs_inline_to_blocks(ino) != 0) {
+                        printk("inode %lu: cannot move inline data out to blocks, size kept at %d\n",
+                               ino->i_ino, LAB5FS_INLINE_SIZE);
+                        i_size_write(ino, LAB5FS_INLINE_SIZE);
+                }
+                if (LAB5FS_INODE_INLINE(ino))
+                        memset(inode_info->i_inline + ino->i_size, 0,
+                               LAB5FS_INLINE_SIZE - ino->i_size);
+                up(&inode_info->i_map_sem);
+                ino->i_mtime = ino->i_ctime = CURRENT_TIME;
+                mark_inode_dirty(ino);
+                lab5fs_journal_stop(&handle);
+                return;
+        }
+
+        /* zero the tail of the last partial block. This locks a page, so
+         * it comes before the handle. */
+        block_truncate_page(ino->i_mapping, ino->i_size, lab5fs_get_block);
+
+        first_block = (ino->i_size + LAB5FS_BLOCK_SIZE - 1) >> LAB5FS_BITS;
+
+        lab5fs_journal_start(ino->i_sb, &handle, LAB5FS_TRUNCATE_CREDITS);
+        down(&inode_info->i_map_sem);
+        lab5fs_extent_truncate(ino, first_block, 1);
+        up(&inode_info->i_map_sem);
 
-        /* TODO - handle directories with more then one data block... */
+        /* a truncate that took several transactions put the file on the
+         * orphan list; an unlinked one stays there for delete_inode. */
+        if (ino->i_nlink && (inode_info->i_flags & LAB5FS_ORPHAN_FL)) {
+                inode_info->i_flags &= ~LAB5FS_ORPHAN_FL;
+                lab5fs_orphan_del(ino);
+        }
+        ino->i_mtime = ino->i_ctime = CURRENT_TIME;
+        mark_inode_dirty(ino);
+        lab5fs_journal_stop(&handle);
+}
 
-        printk("lab5fs Removing link, inode %lu -/-> inode %lu, name=%s\n",
-                   parent_dir->i_ino, child->i_ino, name);
+/*
+ * Change the attributes of a regular file. Extending an inline file past
+ * the inode moves its data out to blocks before i_size changes, so a
+ * failed allocation fails the truncate instead of leaving an inline file
+ * longer than its inline area.
+ */
+int lab5fs_setattr(struct dentry *dentry, struct iattr *attr)
+{
+        struct inode *ino = dentry->d_inode;
+        struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+        struct lab5fs_handle handle;
+        int err;
 
-        err = lab5fs_getblock(parent_dir, &data_block_num);
+        err = inode_change_ok(ino, attr);
         if (err)
-                goto ret_err;
+                return err;
 
-        /* read in the data block of the parent directory. */
-        printk("lab5fs: dir data in block %d\n", data_block_num);
-        if (!(data_bh = sb_bread(sb, data_block_num))) {
-                printk("unable to read dir data block.\n");
-                err = -EIO;
-                goto ret_err;
+        if ((attr->ia_valid & ATTR_SIZE) && LAB5FS_INODE_INLINE(ino) &&
+            attr->ia_size > LAB5FS_INLINE_SIZE) {
+                lab5fs_journal_start(ino->i_sb, &handle, LAB5FS_WRITE_CREDITS);
+                down(&inode_info->i_map_sem);
+                if (LAB5FS_INODE_INLINE(ino))
+                        err = lab5fs_inline_to_blocks(ino);
+                up(&inode_info->i_map_sem);
+                mark_inode_dirty(ino);
+                lab5fs_journal_stop(&handle);
+                if (err)
+                        return err;
         }
+        return inode_setattr(ino, attr);
+}
 
-        /* find the child's entry in the parent directory. */
-        dir_rec = (struct lab5fs_dir *) data_bh->b_data;
-        while (((char*)dir_rec) < ((char*)data_bh->b_data) + LAB5FS_BLOCK_SIZE) {
-                if (le32_to_cpu(dir_rec->dir_name_len) == namelen) {
-                       
-			if (memcmp(dir_rec->dir_name, name, namelen) == 0) {
-				/* we have a match. */
-				found_child = 1;
-				break;
-			}
+/*
+ * Make a file or directory durable. The VFS has already started writing
+ * its dirty pages; once those are done, the inode's own metadata buffers
+ * (extent and directory blocks) are written, and then its inode table
+ * block goes out in one batch with the allocation state it depends on,
+ * followed by a single cache flush. With a journal all of that is one
+ * commit, shared with any other fsync running at the same time.
+ */
+int lab5fs_fsync(struct file *file, struct dentry *dentry, int datasync)
+{
+        struct inode *ino = dentry->d_inode;
+        struct super_block *sb = ino->i_sb;
+        struct buffer_head *ibh = NULL;
+        struct lab5fs_handle handle;
+        unsigned long block_num, offset;
+        int err, ret;
+
+        lab5fs_dbg("fsync inode %lu\n", ino->i_ino);
+
+        ret = filemap_fdatawait(ino->i_mapping);
+        err = sync_mapping_buffers(ino->i_mapping);
+        if (!ret)
+                ret = err;
+
+        lab5fs_journal_start(sb, &handle, 1);
+        err = lab5fs_inode_write_ino(ino, 0);
+        lab5fs_journal_stop(&handle);
+        if (!ret)
+                ret = err;
+        block_num = lab5fs_inode_block(sb, ino->i_ino, &offset);
+        if (block_num)
+                ibh = sb_getblk(sb, block_num);
+
+        err = lab5fs_sync_metadata(sb, ibh, 1);
+        if (!ret)
+                ret = err;
+        if (ibh)
+                brelse(ibh);
+        return ret;
+}
+
+/* Needed for ls. Fill out a VFS inode corresponding to the filename give by the dentry*/
+struct dentry* lab5fs_lookup(struct inode *dir, struct dentry *dentry, struct nameidata *data) {
+	int err = 0;
+	struct inode *inode = NULL;
+	ino_t ino;
+	struct timeval op_start;
+
+	lab5fs_stats_start(&op_start);
+	lab5fs_dbg("lab5fs_lookup:: name: %s, len: %d\n", dentry->d_name.name, dentry->d_name.len);
+	err = lab5fs_getfile(dir, dentry->d_name.name, dentry->d_name.len, &ino);
+	if(!err && ino>0) {
+		lab5fs_dbg("lab5fs_lookup: inode %d\n",(int)ino);
+		inode = lab5fs_iget(dir->i_sb, ino);
+		if (IS_ERR(inode)) {
+			lab5fs_stats_end(dir->i_sb, LAB5FS_OP_LOOKUP, &op_start);
+			return ERR_PTR(PTR_ERR(inode));
 		}
-		dir_rec++;
+	}
+		d_add(dentry, inode);
+	lab5fs_stats_end(dir->i_sb, LAB5FS_OP_LOOKUP, &op_start);
+	return NULL;
+}
+
+/*
+ * Allocate a new inode, to be used when creating a new file or directory.
+ */
+struct inode *lab5fs_inode_new_inode(struct super_block *sb, int mode)
+{
+        struct inode *child_ino = NULL;
+        ino_t ino_num = 0;
+        int err = 0;
+        struct lab5fs_inode_info *inode_info = NULL;
+
+        /* allocate a free inode number; its slot in the inode table comes with it. */
+        ino_num = lab5fs_alloc_inode_num(sb);
+        if (ino_num == 0) {
+                err = -ENOSPC;
+                goto ret_err;
         }
 
-        if (!found_child) {
-                err = -ENOENT;
+        /* allocate a VFS inode object. */
+        child_ino = new_inode(sb);
+        if (!child_ino) {
+                printk("printk: new_inode() failed... inode %lu\n",ino_num);
+                err = -ENOMEM;
                 goto ret_err;
         }
 
-        /* mark this entry as free*/
-        dir_rec->dir_inode = cpu_to_le32(0);
+        /* init the inode's data. */
+        child_ino->i_ino = ino_num;
+        child_ino->i_mode = mode;
+        child_ino->i_nlink = 1;  /* this inode will be stored in a directory,
+                                  * so there's at least one link to this inode,
+                                  * from that directory. */
+        child_ino->i_size = 0;
+        child_ino->i_blksize = LAB5FS_BLOCK_SIZE;
+        child_ino->i_blkbits = 10;
+        child_ino->i_blocks = 0;
+        child_ino->i_uid = current->fsuid;
+        child_ino->i_gid = current->fsgid;
+        child_ino->i_atime = child_ino->i_mtime = child_ino->i_ctime = CURRENT_TIME;
+
 
-        /* clear up the fields, just for safety. */
-        dir_rec->dir_name_len = 0;
-        dir_rec->dir_name[0] = '\0';
-        mark_buffer_dirty(data_bh);
+        /* init the inode's lab5fs metadata. */
+        inode_info = LAB5FS_INODE_INFO(child_ino);
+        lab5fs_extent_init_root(child_ino);
+
+        /* new files and directories start out inline; a directory's
+         * inline area is a single leaf. */
+        inode_info->i_flags = 0;
+        inode_info->i_next_orphan = 0;
+        memset(inode_info->i_inline, 0, sizeof(inode_info->i_inline));
+        if (S_ISREG(mode) || S_ISDIR(mode))
+                inode_info->i_flags |= LAB5FS_INLINE_DATA_FL;
+        if (S_ISDIR(mode))
+                lab5fs_dir_init_leaf((struct lab5fs_dir_head *)inode_info->i_inline,
+                                     LAB5FS_INLINE_DIR_SPACE);
+
+        /* set the inode operations structs. */
+        lab5fs_set_ops(child_ino);
 
-        /* all went well... */
+        insert_inode_hash(child_ino);
+        /* make sure the inode gets written to disk by the inodes cache. */
+        mark_inode_dirty(child_ino);
+
+        /* no errors*/
         err = 0;
         goto ret;
 
   ret_err:
-        /* fallthrough */
+        if (child_ino)
+                iput(child_ino); /* child_ino will be deleted here. */
+        if (ino_num > 0)
+                lab5fs_release_inode_num(sb, ino_num);
   ret:
-        if (data_bh)
-                brelse(data_bh);
-        return err;
+        return (err == 0 ? child_ino : NULL);
 }
 
 /*
@@ -627,16 +1306,22 @@ int lab5fs_inode_create(struct inode *dir, struct dentry *dentry, int mode,struc
 {
         struct inode *ino = NULL;
         int err = 0;
+        struct lab5fs_handle handle;
+        struct timeval op_start;
 
-        printk("Creating inode at %ld, path=%s, mode=%o\n",
+        lab5fs_stats_start(&op_start);
+        lab5fs_dbg("Creating inode at %ld, path=%s, mode=%o\n",
                              dir->i_ino, dentry->d_name.name, mode);
 
         /* allocate an inode for the child, and add it to the directory. */
+        lab5fs_journal_start(dir->i_sb, &handle, LAB5FS_CREATE_CREDITS);
         ino = lab5fs_inode_new_inode (dir->i_sb, mode);
         if (ino!=NULL) {
                 err = lab5fs_add_file(dir, ino, dentry);
         }
+        lab5fs_journal_stop(&handle);
 
+        lab5fs_stats_end(dir->i_sb, LAB5FS_OP_CREATE, &op_start);
         return err;
 }
 
@@ -650,23 +1335,30 @@ int lab5fs_inode_unlink(struct inode *dir, struct dentry *dentry)
         struct inode *child = dentry->d_inode;
         const char* child_name = dentry->d_name.name;
         int child_name_len = dentry->d_name.len;
+        struct lab5fs_handle handle;
+        struct timeval op_start;
 
-        printk("unlink inode %ld, path=%s\n",
+        lab5fs_stats_start(&op_start);
+        lab5fs_dbg("unlink inode %ld, path=%s\n",
                              dir->i_ino, dentry->d_name.name);
 
+        lab5fs_journal_start(dir->i_sb, &handle, LAB5FS_UNLINK_CREDITS);
         err = lab5fs_dir_del_link(dir, child, child_name, child_name_len);
         if (err != 0)
-                return err;
+                goto ret;
 
         /* decrease the number of reference counts*/
         child->i_ctime = dir->i_ctime;
         child->i_nlink--;
         mark_inode_dirty(child);
         
-        printk("parent_i_nlink=%d, child_i_nlink=%d\n",
+        lab5fs_dbg("parent_i_nlink=%d, child_i_nlink=%d\n",
                              dir->i_nlink, child->i_nlink);
 
         err = 0;
+  ret:
+        lab5fs_journal_stop(&handle);
+        lab5fs_stats_end(dir->i_sb, LAB5FS_OP_UNLINK, &op_start);
         return err;
 }
 
@@ -4,27 +4,59 @@
 
 #include <linux/fs.h>
 #include <linux/types.h>
+#include <asm/semaphore.h>
+#include "lab5fs.h"
+
+/*
+ * A recently used translation: logical blocks ec_lblk..ec_lblk+ec_len-1
+ * map to disk blocks ec_pblk on, or are a hole if ec_pblk is 0.
+ */
+struct lab5fs_ext_cache {
+        unsigned long ec_lblk;
+        unsigned long ec_pblk;
+        unsigned long ec_len;           /* 0 if the entry is unused. */
+};
+
+#define LAB5FS_EXT_CACHE_SIZE 4
 
 /* custom lab5fs meta-data inside each VFS inode. */
 struct lab5fs_inode_info {
-        unsigned long  i_block_num;     /* block containing the inode.               */
-       	unsigned long  i_bi_block_num;  /* block containing the inode's data index.  */
+        struct semaphore i_map_sem;     /* serializes changes to the extent tree.    */
+        struct lab5fs_extent_header i_eh;  /* root of the extent tree, as on disk,   */
+        struct lab5fs_extent i_extents[LAB5FS_INODE_EXTENTS]; /* so no block reads. */
+        struct lab5fs_ext_cache i_ext_cache[LAB5FS_EXT_CACHE_SIZE]; /* under i_map_sem, */
+        int i_ext_cache_next;           /* saves walking extent blocks on a hit.     */
+        unsigned long i_ext_leaf;       /* last extent leaf walked to, 0 if none,    */
+        unsigned long i_ext_leaf_start; /* and the logical blocks the index above    */
+        unsigned long i_ext_leaf_end;   /* it sends there. Under i_map_sem.          */
+        u32 i_flags;                    /* LAB5FS_*_FL, as on disk.                  */
+        char i_inline[LAB5FS_INLINE_SIZE]; /* contents while LAB5FS_INLINE_DATA_FL. */
+        u32 i_next_orphan;              /* while LAB5FS_ORPHAN_FL, as on disk.       */
+        struct inode vfs_inode;
 };
 
 /* Macro for getting lab5fs inode meta-data from a VFS inode. */
-#define LAB5FS_INODE_INFO(ino) ((struct lab5fs_inode_info*)((ino)->u.generic_ip))
+#define LAB5FS_INODE_INFO(ino) container_of(ino, struct lab5fs_inode_info, vfs_inode)
+/* True if the inode's contents are kept in i_inline rather than in blocks. */
+#define LAB5FS_INODE_INLINE(ino) (LAB5FS_INODE_INFO(ino)->i_flags & LAB5FS_INLINE_DATA_FL)
 
 /*utility functions*/
-int lab5fs_inode_read_ino (struct inode *, unsigned long);
-int lab5fs_inode_write_ino (struct inode *);
-void lab5fs_inode_clear(struct inode *);
+int lab5fs_init_inodecache(void); //creates the slab lab5fs inodes come from
+void lab5fs_destroy_inodecache(void);
+struct inode *lab5fs_alloc_inode(struct super_block *);
+void lab5fs_destroy_inode(struct inode *);
+int lab5fs_inode_read_ino (struct inode *, unsigned long, unsigned long);
+int lab5fs_inode_write_ino (struct inode *, int);
 void lab5fs_inode_clear_blocks(struct inode *);
 void lab5fs_inode_free_inode(struct inode *ino);
+int lab5fs_get_block(struct inode *, sector_t, struct buffer_head *, int);
 
 /*operations*/
 struct dentry* lab5fs_lookup(struct inode *dir, struct dentry *dentry, struct nameidata *data);
 int lab5fs_inode_create(struct inode *, struct dentry *,int,struct nameidata *);
 int lab5fs_inode_unlink(struct inode *dir, struct dentry *dentry);
-int lab5fs_readdir(struct file *filep, void *dirent, filldir_t fill);
+void lab5fs_truncate(struct inode *);
+int lab5fs_setattr(struct dentry *, struct iattr *);
+int lab5fs_fsync(struct file *, struct dentry *, int);
 
 #endif /* LAB5FS_INODE_H */
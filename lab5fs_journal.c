@@ -0,0 +1,1047 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/blkdev.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/spinlock.h>
+#include <linux/rwsem.h>
+#include <linux/crc32.h>
+#include <asm/semaphore.h>
+#include "lab5fs.h"
+#include "lab5fs_super.h"
+#include "lab5fs_journal.h"
+#include "lab5fs_stats.h"
+
+/*
+ * Metadata journal.
+ *
+ * Operations run inside handles, which hold j_barrier shared. A buffer
+ * dirtied inside a handle joins the running transaction instead of being
+ * marked dirty, so the buffer cache never writes it home on its own.
+ * Committing takes j_barrier exclusively just long enough to copy the
+ * running transaction into log buffers and start a new one; the log
+ * blocks and the commit block then go out as one batch followed by a
+ * single cache flush, which every operation since the previous commit
+ * shares. Committed buffers stay pinned until a checkpoint writes them
+ * home and empties the log, which happens when the log is half full and
+ * at unmount.
+ *
+ * File data is not logged, but it is ordered: the data buffers of blocks
+ * a transaction allocated are written before the transaction commits, so
+ * a committed extent never points at a block still holding old contents.
+ *
+ * Starting a handle may wait for a commit, and a commit waits for the
+ * running handles, so a handle is always started before taking
+ * i_map_sem or s_orphan_sem and never while holding a page lock another
+ * handle may need.
+ */
+
+#define LAB5FS_HANDLE_MAGIC 0x4A48444C
+
+enum lab5fs_journal_state_bits {
+	BH_Lab5fsTrans = BH_PrivateStart, /*in the running transaction*/
+	BH_Lab5fsCkpt, /*committed, not yet written home*/
+};
+
+BUFFER_FNS(Lab5fsTrans, lab5fs_trans)
+BUFFER_FNS(Lab5fsCkpt, lab5fs_ckpt)
+TAS_BUFFER_FNS(Lab5fsCkpt, lab5fs_ckpt)
+
+struct lab5fs_journal {
+	struct super_block *j_sb;
+	unsigned long j_first; /*disk block of the journal super block*/
+	unsigned long j_blocks; /*length of the journal*/
+	struct buffer_head *j_sbh;
+
+	/*log positions count from j_first and run from 1 to j_blocks - 1*/
+	unsigned long j_head; /*where the next transaction goes*/
+	unsigned long j_free; /*log blocks not holding a live transaction*/
+	u32 j_sequence; /*of the running transaction*/
+	u32 j_committed; /*last transaction known to be on disk*/
+	int j_max_buffers; /*most buffers one transaction may hold*/
+	int j_max_trans; /*credits granted before a transaction is committed*/
+
+	struct rw_semaphore j_barrier; /*shared by handles, exclusive in commit*/
+	struct semaphore j_commit_sem; /*one commit at a time*/
+
+	/*running transaction, under j_lock*/
+	spinlock_t j_lock;
+	int j_reserved; /*credits granted to its handles*/
+	int j_nr;
+	struct buffer_head **j_bhs;
+	int j_nr_revoke;
+	u32 *j_revoke; /*freed blocks that committed transactions logged*/
+	struct list_head j_data; /*data buffers of blocks it allocated, on b_assoc_buffers*/
+
+	/*committed buffers waiting for a checkpoint, under j_lock*/
+	int j_nr_ckpt;
+	struct buffer_head **j_ckpt;
+
+	struct buffer_head **j_log; /*log buffers of the commit in progress*/
+};
+
+static inline unsigned long lab5fs_journal_next(struct lab5fs_journal *j,
+                                                unsigned long pos)
+{
+        return pos + 1 < j->j_blocks ? pos + 1 : 1;
+}
+
+static inline unsigned long lab5fs_journal_tag_blocks(unsigned long n)
+{
+        return (n + LAB5FS_JOURNAL_TAGS - 1) / LAB5FS_JOURNAL_TAGS;
+}
+
+/* Log blocks that committing the running transaction will take. */
+static unsigned long lab5fs_journal_need(struct lab5fs_journal *j)
+{
+        return lab5fs_journal_tag_blocks(j->j_nr_revoke) +
+               lab5fs_journal_tag_blocks(j->j_nr) + j->j_nr + 1;
+}
+
+static int lab5fs_journal_flush(struct super_block *sb)
+{
+        int err = blkdev_issue_flush(sb->s_bdev, NULL);
+
+        /* devices without a write cache have nothing to flush. */
+        return err == -EOPNOTSUPP ? 0 : err;
+}
+
+/* The handle the current task holds on this journal, if any. */
+static struct lab5fs_handle *lab5fs_current_handle(struct lab5fs_journal *j)
+{
+        struct lab5fs_handle *h = current->journal_info;
+
+        if (h && h->h_magic == LAB5FS_HANDLE_MAGIC && h->h_journal == j)
+                return h;
+        return NULL;
+}
+
+/*
+ * Grant credits to a handle not yet made current, committing the running
+ * transaction first if it cannot take that many. A request no transaction
+ * can hold is refused rather than cut down, since the handle would then
+ * run out part way through its operation.
+ */
+static int lab5fs_journal_reserve(struct super_block *sb,
+                                  struct lab5fs_journal *j,
+                                  struct lab5fs_handle *h, int credits)
+{
+        if (credits <= 0 || credits > j->j_max_trans) {
+                printk("lab5fs: handle asks for %d credits, journal grants %d\n",
+                       credits, j->j_max_trans);
+                WARN_ON(1);
+                return -EFBIG;
+        }
+        h->h_credits = credits;
+        h->h_used = 0;
+        for (;;) {
+                down_read(&j->j_barrier);
+                spin_lock(&j->j_lock);
+                if (j->j_reserved + credits <= j->j_max_trans) {
+                        j->j_reserved += credits;
+                        spin_unlock(&j->j_lock);
+                        return 0;
+                }
+                spin_unlock(&j->j_lock);
+                up_read(&j->j_barrier);
+                lab5fs_journal_commit(sb);
+        }
+}
+
+/* Give back the credits a handle did not use, and let commits through. */
+static void lab5fs_journal_release_handle(struct lab5fs_journal *j,
+                                          struct lab5fs_handle *h)
+{
+        spin_lock(&j->j_lock);
+        j->j_reserved += h->h_used - h->h_credits;
+        spin_unlock(&j->j_lock);
+        up_read(&j->j_barrier);
+}
+
+/*
+ * Begin an operation that will dirty up to credits metadata blocks. If
+ * the running transaction cannot take that many, it is committed first.
+ * On a volume without a journal this does nothing. -EFBIG if one
+ * transaction cannot hold credits; the handle is then inert, and stopping
+ * it does nothing.
+ */
+int lab5fs_journal_start(struct super_block *sb, struct lab5fs_handle *h,
+                         int credits)
+{
+        struct lab5fs_journal *j = LAB5FS_SB_INFO(sb)->s_journal;
+        int err;
+
+        memset(h, 0, sizeof(*h));
+        h->h_magic = LAB5FS_HANDLE_MAGIC;
+        h->h_journal = j;
+        if (!j)
+                return 0;
+        if (lab5fs_current_handle(j)) {
+                h->h_nested = 1;
+                return 0;
+        }
+
+        if ((err = lab5fs_journal_reserve(sb, j, h, credits))) {
+                h->h_journal = NULL;
+                return err;
+        }
+        h->h_saved = current->journal_info;
+        current->journal_info = h;
+        return 0;
+}
+
+/* End an operation; its buffers commit with the running transaction. */
+void lab5fs_journal_stop(struct lab5fs_handle *h)
+{
+        struct lab5fs_journal *j = h->h_journal;
+
+        if (!j || h->h_nested)
+                return;
+        current->journal_info = h->h_saved;
+        lab5fs_journal_release_handle(j, h);
+}
+
+/*
+ * Credits the current task's handle has left; a task outside any handle,
+ * or on a volume without a journal, is not limited.
+ */
+int lab5fs_journal_credits(struct super_block *sb)
+{
+        struct lab5fs_journal *j = LAB5FS_SB_INFO(sb)->s_journal;
+        struct lab5fs_handle *h;
+
+        if (!j || !(h = lab5fs_current_handle(j)))
+                return INT_MAX;
+        return h->h_credits - h->h_used;
+}
+
+/*
+ * Let an operation too large for one transaction, such as freeing a big
+ * file, go on in the next one. The current handle is given back, so what
+ * it did so far may commit on its own, and then granted credits afresh.
+ * The caller must have left the metadata consistent and must not hold
+ * i_map_sem or any other lock a handle may be waiting on with j_barrier
+ * held. On error the handle is left inert, as a failed start leaves it.
+ */
+int lab5fs_journal_restart(struct super_block *sb, int credits)
+{
+        struct lab5fs_journal *j = LAB5FS_SB_INFO(sb)->s_journal;
+        struct lab5fs_handle *h;
+        int err;
+
+        if (!j || !(h = lab5fs_current_handle(j)))
+                return 0;
+        lab5fs_dbg("restarting handle after %d of %d credits\n",
+                   h->h_used, h->h_credits);
+
+        /* the reserve loop may commit, which is refused inside a handle. */
+        current->journal_info = h->h_saved;
+        lab5fs_journal_release_handle(j, h);
+        if ((err = lab5fs_journal_reserve(sb, j, h, credits))) {
+                h->h_journal = NULL;
+                return err;
+        }
+        current->journal_info = h;
+        return 0;
+}
+
+/*
+ * Record that a metadata buffer was modified. With a journal the buffer
+ * joins the running transaction, pinned and left clean; without one it is
+ * simply marked dirty, against ino if given so fsync finds it.
+ */
+int lab5fs_journal_dirty(struct super_block *sb, struct inode *ino,
+                         struct buffer_head *bh)
+{
+        struct lab5fs_journal *j = LAB5FS_SB_INFO(sb)->s_journal;
+        struct lab5fs_handle *h, handle;
+        int err;
+
+        if (!j) {
+                if (ino)
+                        mark_buffer_dirty_inode(bh, ino);
+                else
+                        mark_buffer_dirty(bh);
+                return 0;
+        }
+
+        h = lab5fs_current_handle(j);
+        if (!h) {
+                /* not inside an operation: log the buffer on its own. */
+                lab5fs_journal_start(sb, &handle, 1);
+                err = lab5fs_journal_dirty(sb, ino, bh);
+                lab5fs_journal_stop(&handle);
+                return err;
+        }
+
+        sb->s_dirt = 1;
+        spin_lock(&j->j_lock);
+        if (buffer_lab5fs_trans(bh)) {
+                spin_unlock(&j->j_lock);
+                return 0;
+        }
+        if (unlikely(h->h_used >= h->h_credits)) {
+                /* the caller reserved too few. The transaction keeps half
+                 * of j_max_buffers spare, so while that lasts the buffer is
+                 * still logged; past it, it is written in place. */
+                spin_unlock(&j->j_lock);
+                printk("lab5fs: handle out of credits (%d) at block %llu\n",
+                       h->h_credits, (unsigned long long)bh->b_blocknr);
+                WARN_ON(1);
+                spin_lock(&j->j_lock);
+                if (j->j_nr >= j->j_max_buffers) {
+                        spin_unlock(&j->j_lock);
+                        mark_buffer_dirty(bh);
+                        return -ENOSPC;
+                }
+                err = -ENOSPC;
+        } else
+                err = 0;
+        set_buffer_lab5fs_trans(bh);
+        get_bh(bh);
+        j->j_bhs[j->j_nr++] = bh;
+        h->h_used++;
+        spin_unlock(&j->j_lock);
+        return err;
+}
+
+/*
+ * Ordered data: bh, a page cache buffer of a file, was just mapped to a
+ * block allocated by the current handle. The commit of the transaction
+ * writes it before the metadata pointing at the block, so a crash never
+ * leaves a file showing whatever the block held before. The buffer is
+ * listed on its b_assoc_buffers, which only metadata buffers of the block
+ * device are otherwise put on.
+ */
+void lab5fs_journal_dirty_data(struct super_block *sb, struct buffer_head *bh)
+{
+        struct lab5fs_journal *j = LAB5FS_SB_INFO(sb)->s_journal;
+
+        if (!j || !lab5fs_current_handle(j))
+                return;
+        spin_lock(&j->j_lock);
+        if (list_empty(&bh->b_assoc_buffers)) {
+                get_bh(bh);
+                list_add_tail(&bh->b_assoc_buffers, &j->j_data);
+        }
+        spin_unlock(&j->j_lock);
+}
+
+/*
+ * Blocks start..start+count-1 are being freed. Copies of them in the
+ * running transaction are dropped; copies already committed are dropped
+ * too, and revoked, so that neither a checkpoint nor a replay after a
+ * crash writes them over whatever the blocks are used for next.
+ */
+void lab5fs_journal_forget(struct super_block *sb, unsigned long start,
+                           unsigned long count)
+{
+        struct lab5fs_journal *j = LAB5FS_SB_INFO(sb)->s_journal;
+        struct buffer_head *bh;
+        int i;
+
+        if (!j)
+                return;
+
+        spin_lock(&j->j_lock);
+        for (i = 0; i < j->j_nr; ) {
+                bh = j->j_bhs[i];
+                if (bh->b_blocknr < start || bh->b_blocknr >= start + count) {
+                        i++;
+                        continue;
+                }
+                clear_buffer_lab5fs_trans(bh);
+                j->j_bhs[i] = j->j_bhs[--j->j_nr];
+                brelse(bh);
+        }
+        for (i = 0; i < j->j_nr_ckpt; ) {
+                bh = j->j_ckpt[i];
+                if (bh->b_blocknr < start || bh->b_blocknr >= start + count) {
+                        i++;
+                        continue;
+                }
+                clear_buffer_lab5fs_ckpt(bh);
+                j->j_ckpt[i] = j->j_ckpt[--j->j_nr_ckpt];
+                j->j_revoke[j->j_nr_revoke++] = bh->b_blocknr;
+                brelse(bh);
+        }
+        spin_unlock(&j->j_lock);
+}
+
+/*
+ * Get log block pos ready to be written: a copy of src if given, otherwise
+ * an empty block of the given type.
+ */
+static struct buffer_head *lab5fs_journal_getblk(struct lab5fs_journal *j,
+                                                 unsigned long pos, int type,
+                                                 u32 seq, struct buffer_head *src)
+{
+        struct lab5fs_journal_header *hdr;
+        struct buffer_head *bh;
+
+        if (!(bh = sb_getblk(j->j_sb, j->j_first + pos)))
+                return NULL;
+        lock_buffer(bh);
+        if (src) {
+                memcpy(bh->b_data, src->b_data, LAB5FS_BLOCK_SIZE);
+        } else {
+                memset(bh->b_data, 0, LAB5FS_BLOCK_SIZE);
+                hdr = (struct lab5fs_journal_header *)bh->b_data;
+                hdr->jh_magic = cpu_to_le32(LAB5FS_JOURNAL_MAGIC);
+                hdr->jh_type = cpu_to_le32(type);
+                hdr->jh_sequence = cpu_to_le32(seq);
+        }
+        set_buffer_uptodate(bh);
+        unlock_buffer(bh);
+        return bh;
+}
+
+/*
+ * Copy the running transaction into j_log: its revoke blocks, then each
+ * descriptor followed by the blocks it lists, then the commit block. The
+ * buffers move to the checkpoint list and a new transaction begins.
+ * Called with j_commit_sem held and j_barrier held exclusively.
+ * returns the number of log buffers, or a negative error code.
+ */
+static int lab5fs_journal_copy(struct lab5fs_journal *j)
+{
+        struct lab5fs_journal_tags *tags;
+        struct lab5fs_journal_commit *commit;
+        struct buffer_head *bh;
+        unsigned long pos = j->j_head;
+        u32 seq = j->j_sequence, crc = seq;
+        int n = 0, i, k, count;
+
+        for (i = 0; i < j->j_nr_revoke; i += count) {
+                count = min_t(int, j->j_nr_revoke - i, LAB5FS_JOURNAL_TAGS);
+                if (!(bh = lab5fs_journal_getblk(j, pos, LAB5FS_JOURNAL_REVOKE, seq, NULL)))
+                        goto ret_err;
+                tags = (struct lab5fs_journal_tags *)bh->b_data;
+                tags->jt_header.jh_count = cpu_to_le32(count);
+                for (k = 0; k < count; k++)
+                        tags->jt_blocks[k] = cpu_to_le32(j->j_revoke[i + k]);
+                crc = crc32_le(crc, bh->b_data, LAB5FS_BLOCK_SIZE);
+                j->j_log[n++] = bh;
+                pos = lab5fs_journal_next(j, pos);
+        }
+
+        for (i = 0; i < j->j_nr; i += count) {
+                count = min_t(int, j->j_nr - i, LAB5FS_JOURNAL_TAGS);
+                if (!(bh = lab5fs_journal_getblk(j, pos, LAB5FS_JOURNAL_DESC, seq, NULL)))
+                        goto ret_err;
+                tags = (struct lab5fs_journal_tags *)bh->b_data;
+                tags->jt_header.jh_count = cpu_to_le32(count);
+                for (k = 0; k < count; k++)
+                        tags->jt_blocks[k] = cpu_to_le32(j->j_bhs[i + k]->b_blocknr);
+                crc = crc32_le(crc, bh->b_data, LAB5FS_BLOCK_SIZE);
+                j->j_log[n++] = bh;
+                pos = lab5fs_journal_next(j, pos);
+
+                for (k = 0; k < count; k++) {
+                        if (!(bh = lab5fs_journal_getblk(j, pos, 0, seq, j->j_bhs[i + k])))
+                                goto ret_err;
+                        crc = crc32_le(crc, bh->b_data, LAB5FS_BLOCK_SIZE);
+                        j->j_log[n++] = bh;
+                        pos = lab5fs_journal_next(j, pos);
+                }
+        }
+
+        if (!(bh = lab5fs_journal_getblk(j, pos, LAB5FS_JOURNAL_COMMIT, seq, NULL)))
+                goto ret_err;
+        commit = (struct lab5fs_journal_commit *)bh->b_data;
+        commit->jc_header.jh_count = cpu_to_le32(j->j_nr);
+        commit->jc_checksum = cpu_to_le32(crc);
+        j->j_log[n++] = bh;
+        pos = lab5fs_journal_next(j, pos);
+
+        spin_lock(&j->j_lock);
+        for (i = 0; i < j->j_nr; i++) {
+                bh = j->j_bhs[i];
+                clear_buffer_lab5fs_trans(bh);
+                if (test_set_buffer_lab5fs_ckpt(bh))
+                        brelse(bh); /*pinned by an earlier transaction*/
+                else
+                        j->j_ckpt[j->j_nr_ckpt++] = bh;
+        }
+        j->j_nr = 0;
+        j->j_nr_revoke = 0;
+        j->j_reserved = 0;
+        j->j_sequence++;
+        spin_unlock(&j->j_lock);
+
+        j->j_head = pos;
+        j->j_free -= n;
+        return n;
+
+  ret_err:
+        while (n > 0)
+                brelse(j->j_log[--n]);
+        return -ENOMEM;
+}
+
+/*
+ * Last resort when the running transaction cannot be logged: hand its
+ * buffers to the buffer cache to write home unordered.
+ */
+static void lab5fs_journal_unjournal(struct lab5fs_journal *j)
+{
+        struct buffer_head *bh;
+        int i;
+
+        printk("lab5fs: cannot log transaction %u, writing %d blocks unjournaled\n",
+               j->j_sequence, j->j_nr);
+        spin_lock(&j->j_lock);
+        for (i = 0; i < j->j_nr; i++) {
+                bh = j->j_bhs[i];
+                clear_buffer_lab5fs_trans(bh);
+                mark_buffer_dirty(bh);
+                brelse(bh);
+        }
+        j->j_nr = 0;
+        j->j_nr_revoke = 0;
+        j->j_reserved = 0;
+        j->j_sequence++;
+        spin_unlock(&j->j_lock);
+}
+
+/*
+ * Write the data buffers listed by lab5fs_journal_dirty_data and wait for
+ * them. Called with j_barrier held exclusively, so no handle can list,
+ * punch or map a buffer meanwhile. One truncated or punched since it was
+ * listed is unmapped and clean by now, and is skipped.
+ * returns 0 on success, a negative error code on failure.
+ */
+static int lab5fs_journal_write_data(struct lab5fs_journal *j)
+{
+        struct buffer_head *bh;
+        LIST_HEAD(list);
+        int err = 0;
+
+        spin_lock(&j->j_lock);
+        list_splice_init(&j->j_data, &list);
+        spin_unlock(&j->j_lock);
+
+        list_for_each_entry(bh, &list, b_assoc_buffers)
+                if (buffer_mapped(bh) && buffer_dirty(bh))
+                        ll_rw_block(WRITE, 1, &bh);
+        while (!list_empty(&list)) {
+                bh = list_entry(list.next, struct buffer_head, b_assoc_buffers);
+                list_del_init(&bh->b_assoc_buffers);
+                wait_on_buffer(bh);
+                if (buffer_mapped(bh) && buffer_dirty(bh))
+                        sync_dirty_buffer(bh);
+                if (buffer_mapped(bh) && !buffer_uptodate(bh))
+                        err = -EIO;
+                brelse(bh);
+        }
+        if (err)
+                printk("lab5fs: error writing data of transaction %u\n",
+                       j->j_sequence);
+        return err;
+}
+
+/*
+ * Write every committed buffer home and start the log over at its head.
+ * Called with j_commit_sem held and j_barrier held exclusively, with an
+ * empty running transaction, so the buffers hold just what was committed.
+ * returns 0 on success, a negative error code on failure.
+ */
+static int lab5fs_journal_checkpoint(struct lab5fs_journal *j)
+{
+        struct lab5fs_journal_super *js = (struct lab5fs_journal_super *)j->j_sbh->b_data;
+        struct buffer_head *bh;
+        int i, err = 0;
+
+        if (j->j_free == j->j_blocks - 1)
+                return 0;
+
+        for (i = 0; i < j->j_nr_ckpt; i++)
+                mark_buffer_dirty(j->j_ckpt[i]);
+        if (j->j_nr_ckpt)
+                ll_rw_block(WRITE, j->j_nr_ckpt, j->j_ckpt);
+        for (i = 0; i < j->j_nr_ckpt; i++) {
+                bh = j->j_ckpt[i];
+                wait_on_buffer(bh);
+                if (buffer_dirty(bh))
+                        sync_dirty_buffer(bh);
+                if (!buffer_uptodate(bh))
+                        err = -EIO;
+                clear_buffer_lab5fs_ckpt(bh);
+                brelse(bh);
+        }
+        j->j_nr_ckpt = 0;
+        if (!err)
+                err = lab5fs_journal_flush(j->j_sb);
+        if (err) {
+                printk("lab5fs: error writing back journaled blocks\n");
+                return err;
+        }
+
+        lock_buffer(j->j_sbh);
+        js->js_start = cpu_to_le32(j->j_head);
+        js->js_sequence = cpu_to_le32(j->j_sequence);
+        unlock_buffer(j->j_sbh);
+        mark_buffer_dirty(j->j_sbh);
+        err = sync_dirty_buffer(j->j_sbh);
+        if (!err)
+                j->j_free = j->j_blocks - 1;
+        return err;
+}
+
+/*
+ * Commit the running transaction. The copy is made with j_barrier held;
+ * it is released before the I/O unless the log needs a checkpoint
+ * afterwards, which must not see buffers of a newer transaction.
+ * Called with j_commit_sem held.
+ * returns 0 on success, a negative error code on failure.
+ */
+static int lab5fs_journal_do_commit(struct lab5fs_journal *j)
+{
+        struct super_block *sb = j->j_sb;
+        struct buffer_head *bh;
+        struct timeval op_start;
+        u32 seq;
+        int n, i, ckpt, data_err, err = 0;
+
+        down_write(&j->j_barrier);
+        /* the data of blocks the transaction allocated goes first. */
+        data_err = lab5fs_journal_write_data(j);
+        if (j->j_nr == 0 && j->j_nr_revoke == 0) {
+                /* credits of buffers forgotten since still count. */
+                j->j_reserved = 0;
+                up_write(&j->j_barrier);
+                return data_err;
+        }
+
+        lab5fs_stats_start(&op_start);
+        seq = j->j_sequence;
+        n = -ENOSPC;
+        if (lab5fs_journal_need(j) <= j->j_free)
+                n = lab5fs_journal_copy(j);
+        if (n < 0) {
+                lab5fs_journal_unjournal(j);
+                up_write(&j->j_barrier);
+                return n;
+        }
+
+        ckpt = j->j_free < (j->j_blocks - 1) / 2;
+        if (!ckpt)
+                up_write(&j->j_barrier);
+
+        for (i = 0; i < n; i++)
+                mark_buffer_dirty(j->j_log[i]);
+        ll_rw_block(WRITE, n, j->j_log);
+        for (i = 0; i < n; i++) {
+                bh = j->j_log[i];
+                wait_on_buffer(bh);
+                if (buffer_dirty(bh))
+                        sync_dirty_buffer(bh);
+                if (!buffer_uptodate(bh))
+                        err = -EIO;
+                brelse(bh);
+        }
+        if (!err)
+                err = lab5fs_journal_flush(sb);
+        if (err)
+                printk("lab5fs: error committing transaction %u\n", seq);
+        else
+                j->j_committed = seq;
+        lab5fs_dbg("committed transaction %u in %d log blocks\n", seq, n);
+
+        if (ckpt) {
+                if (!err)
+                        err = lab5fs_journal_checkpoint(j);
+                up_write(&j->j_barrier);
+        }
+        lab5fs_stats_end(sb, LAB5FS_OP_COMMIT, &op_start);
+        return err ? err : data_err;
+}
+
+/*
+ * Make everything done so far durable. Callers that arrive while a
+ * commit is running wait for it and then commit the operations that came
+ * in meanwhile together; a caller whose operations a commit already
+ * covered returns without writing anything.
+ * returns 0 on success, a negative error code on failure.
+ */
+int lab5fs_journal_commit(struct super_block *sb)
+{
+        struct lab5fs_journal *j = LAB5FS_SB_INFO(sb)->s_journal;
+        u32 seq;
+        int err = 0;
+
+        if (!j)
+                return 0;
+        if (lab5fs_current_handle(j)) {
+                printk("lab5fs: commit requested inside a handle\n");
+                return -EDEADLK;
+        }
+
+        spin_lock(&j->j_lock);
+        seq = j->j_sequence;
+        spin_unlock(&j->j_lock);
+
+        down(&j->j_commit_sem);
+        if ((s32)(j->j_committed - seq) < 0)
+                err = lab5fs_journal_do_commit(j);
+        up(&j->j_commit_sem);
+        return err;
+}
+
+/*
+ * Recovery. Transactions are read from js_start for as long as each
+ * carries the next sequence number and ends in a commit block with a
+ * matching checksum; the first one that does not is the end of the log.
+ */
+enum { LAB5FS_PASS_SCAN, LAB5FS_PASS_REVOKE, LAB5FS_PASS_REPLAY };
+
+struct lab5fs_revoke {
+	u32 r_block;
+	u32 r_sequence; /*transaction that freed the block*/
+};
+
+struct lab5fs_replay {
+	unsigned long r_end; /*log block after the last complete transaction*/
+	u32 r_end_sequence; /*first sequence not found complete*/
+	unsigned long r_nr_revoke;
+	struct lab5fs_revoke *r_revoke;
+};
+
+/* Read log block pos; type is set to its block type if it belongs to seq, else 0. */
+static struct buffer_head *lab5fs_journal_bread(struct lab5fs_journal *j,
+                                                unsigned long pos, u32 seq,
+                                                int *type)
+{
+        struct lab5fs_journal_header *hdr;
+        struct buffer_head *bh;
+
+        *type = 0;
+        if (!(bh = sb_bread(j->j_sb, j->j_first + pos))) {
+                printk("lab5fs: unable to read journal block %lu\n", pos);
+                return NULL;
+        }
+        hdr = (struct lab5fs_journal_header *)bh->b_data;
+        if (le32_to_cpu(hdr->jh_magic) == LAB5FS_JOURNAL_MAGIC &&
+            le32_to_cpu(hdr->jh_sequence) == seq)
+                *type = le32_to_cpu(hdr->jh_type);
+        return bh;
+}
+
+/* True if block was freed by a transaction later than seq. */
+static int lab5fs_journal_revoked(struct lab5fs_replay *r, u32 block, u32 seq)
+{
+        unsigned long i;
+
+        for (i = 0; i < r->r_nr_revoke; i++)
+                if (r->r_revoke[i].r_block == block &&
+                    (s32)(r->r_revoke[i].r_sequence - seq) > 0)
+                        return 1;
+        return 0;
+}
+
+/* Copy a logged block home. */
+static int lab5fs_journal_replay_block(struct lab5fs_journal *j,
+                                       struct buffer_head *src, u32 block)
+{
+        struct buffer_head *bh;
+
+        if (block >= j->j_first && block < j->j_first + j->j_blocks) {
+                printk("lab5fs: journal block %u logged, not replayed\n", block);
+                return 0;
+        }
+        if (!(bh = sb_getblk(j->j_sb, block)))
+                return -EIO;
+        lock_buffer(bh);
+        memcpy(bh->b_data, src->b_data, LAB5FS_BLOCK_SIZE);
+        set_buffer_uptodate(bh);
+        unlock_buffer(bh);
+        mark_buffer_dirty(bh);
+        brelse(bh);
+        return 0;
+}
+
+/*
+ * One pass over the log. LAB5FS_PASS_SCAN checks each transaction's
+ * checksum to find where the complete ones end, and counts revoke
+ * records; the other passes stop there. LAB5FS_PASS_REVOKE collects the
+ * revoke records and LAB5FS_PASS_REPLAY copies the logged blocks home,
+ * skipping those a later transaction freed.
+ * returns 0 on success, a negative error code on failure.
+ */
+static int lab5fs_journal_pass(struct lab5fs_journal *j, int pass,
+                               struct lab5fs_replay *r)
+{
+        struct lab5fs_journal_super *js = (struct lab5fs_journal_super *)j->j_sbh->b_data;
+        struct lab5fs_journal_commit *commit;
+        struct lab5fs_journal_tags *tags;
+        struct buffer_head *bh, *dbh;
+        unsigned long pos = le32_to_cpu(js->js_start), txn_pos, len;
+        u32 seq = le32_to_cpu(js->js_sequence), crc, block;
+        int type, count, k, complete, err = 0;
+
+        for (;;) {
+                txn_pos = pos;
+                if (pass != LAB5FS_PASS_SCAN && seq == r->r_end_sequence)
+                        break;
+
+                crc = seq;
+                for (len = 1; ; len++) {
+                        if (len >= j->j_blocks || !(bh = lab5fs_journal_bread(j, pos, seq, &type)))
+                                goto end;
+                        if (type == LAB5FS_JOURNAL_COMMIT) {
+                                commit = (struct lab5fs_journal_commit *)bh->b_data;
+                                complete = pass != LAB5FS_PASS_SCAN ||
+                                           le32_to_cpu(commit->jc_checksum) == crc;
+                                brelse(bh);
+                                if (!complete)
+                                        goto end;
+                                pos = lab5fs_journal_next(j, pos);
+                                break;
+                        }
+                        tags = (struct lab5fs_journal_tags *)bh->b_data;
+                        count = le32_to_cpu(tags->jt_header.jh_count);
+                        if ((type != LAB5FS_JOURNAL_DESC && type != LAB5FS_JOURNAL_REVOKE) ||
+                            count > LAB5FS_JOURNAL_TAGS) {
+                                brelse(bh);
+                                goto end;
+                        }
+                        crc = crc32_le(crc, bh->b_data, LAB5FS_BLOCK_SIZE);
+                        pos = lab5fs_journal_next(j, pos);
+
+                        if (type == LAB5FS_JOURNAL_REVOKE) {
+                                for (k = 0; k < count; k++) {
+                                        if (pass == LAB5FS_PASS_REVOKE) {
+                                                r->r_revoke[r->r_nr_revoke].r_block =
+                                                        le32_to_cpu(tags->jt_blocks[k]);
+                                                r->r_revoke[r->r_nr_revoke].r_sequence = seq;
+                                        }
+                                        if (pass != LAB5FS_PASS_REPLAY)
+                                                r->r_nr_revoke++;
+                                }
+                                brelse(bh);
+                                continue;
+                        }
+
+                        for (k = 0; k < count && !err; k++, len++) {
+                                if (len + 1 >= j->j_blocks ||
+                                    !(dbh = sb_bread(j->j_sb, j->j_first + pos))) {
+                                        brelse(bh);
+                                        goto end;
+                                }
+                                block = le32_to_cpu(tags->jt_blocks[k]);
+                                if (pass == LAB5FS_PASS_SCAN)
+                                        crc = crc32_le(crc, dbh->b_data, LAB5FS_BLOCK_SIZE);
+                                else if (pass == LAB5FS_PASS_REPLAY &&
+                                         !lab5fs_journal_revoked(r, block, seq))
+                                        err = lab5fs_journal_replay_block(j, dbh, block);
+                                brelse(dbh);
+                                pos = lab5fs_journal_next(j, pos);
+                        }
+                        brelse(bh);
+                        if (err)
+                                return err;
+                }
+                seq++;
+        }
+
+  end:
+        if (pass == LAB5FS_PASS_SCAN) {
+                r->r_end = txn_pos;
+                r->r_end_sequence = seq;
+        }
+        return err;
+}
+
+/*
+ * Replay the complete transactions left in the log by a crash, then mark
+ * the log empty. On return j_head and j_sequence say where logging
+ * resumes.
+ * returns 0 on success, a negative error code on failure.
+ */
+static int lab5fs_journal_recover(struct lab5fs_journal *j)
+{
+        struct super_block *sb = j->j_sb;
+        struct lab5fs_journal_super *js = (struct lab5fs_journal_super *)j->j_sbh->b_data;
+        struct lab5fs_replay r;
+        u32 seq = le32_to_cpu(js->js_sequence);
+        unsigned long nr_revoke;
+        int err;
+
+        memset(&r, 0, sizeof(r));
+        err = lab5fs_journal_pass(j, LAB5FS_PASS_SCAN, &r);
+        if (err)
+                return err;
+        j->j_head = r.r_end;
+        j->j_sequence = r.r_end_sequence;
+        if (r.r_end_sequence == seq)
+                return 0;
+
+        if (bdev_read_only(sb->s_bdev)) {
+                printk("lab5fs: journal needs recovery but the device is read-only\n");
+                return -EROFS;
+        }
+        printk("lab5fs: replaying journal transactions %u-%u\n",
+               seq, r.r_end_sequence - 1);
+
+        nr_revoke = r.r_nr_revoke;
+        if (nr_revoke) {
+                r.r_revoke = vmalloc(nr_revoke * sizeof(struct lab5fs_revoke));
+                if (!r.r_revoke)
+                        return -ENOMEM;
+                r.r_nr_revoke = 0;
+                err = lab5fs_journal_pass(j, LAB5FS_PASS_REVOKE, &r);
+        }
+        if (!err)
+                err = lab5fs_journal_pass(j, LAB5FS_PASS_REPLAY, &r);
+        if (r.r_revoke)
+                vfree(r.r_revoke);
+        if (!err)
+                err = sync_blockdev(sb->s_bdev);
+        if (!err)
+                err = lab5fs_journal_flush(sb);
+        if (err) {
+                printk("lab5fs: journal replay failed\n");
+                return err;
+        }
+
+        lock_buffer(j->j_sbh);
+        js->js_start = cpu_to_le32(j->j_head);
+        js->js_sequence = cpu_to_le32(j->j_sequence);
+        unlock_buffer(j->j_sbh);
+        mark_buffer_dirty(j->j_sbh);
+        return sync_dirty_buffer(j->j_sbh);
+}
+
+static void lab5fs_journal_free(struct lab5fs_journal *j)
+{
+        struct buffer_head *bh;
+        int i;
+
+        while (!list_empty(&j->j_data)) {
+                bh = list_entry(j->j_data.next, struct buffer_head, b_assoc_buffers);
+                list_del_init(&bh->b_assoc_buffers);
+                brelse(bh);
+        }
+
+        for (i = 0; i < j->j_nr; i++) {
+                clear_buffer_lab5fs_trans(j->j_bhs[i]);
+                brelse(j->j_bhs[i]);
+        }
+        for (i = 0; i < j->j_nr_ckpt; i++) {
+                clear_buffer_lab5fs_ckpt(j->j_ckpt[i]);
+                brelse(j->j_ckpt[i]);
+        }
+        brelse(j->j_sbh);
+        kfree(j->j_bhs);
+        kfree(j->j_ckpt);
+        kfree(j->j_log);
+        kfree(j->j_revoke);
+        kfree(j);
+}
+
+/*
+ * Set up the journal described by the super block, replaying whatever a
+ * crash left in it. This runs before any other metadata is read, since
+ * the replay may rewrite it. A volume made without a journal mounts as
+ * before, with metadata written back unordered.
+ * returns 0 on success, a negative error code on failure.
+ */
+int lab5fs_journal_load(struct super_block *sb, struct lab5fs_sb_info *sb_info)
+{
+        struct lab5fs_super_block *disk_sb = sb_info->s_lab5fs_sb;
+        struct lab5fs_journal *j;
+        struct lab5fs_journal_super *js;
+        unsigned long first = le32_to_cpu(disk_sb->s_journal_block);
+        unsigned long blocks = le32_to_cpu(disk_sb->s_journal_blocks);
+        int err = -EINVAL;
+
+        if (blocks == 0) {
+                printk("lab5fs: volume has no journal\n");
+                return 0;
+        }
+        if (blocks < LAB5FS_JOURNAL_MIN_BLOCKS || first <= LAB5FS_GDT_FIRST_NUM ||
+            first + blocks > le32_to_cpu(disk_sb->s_blocks_count)) {
+                printk("Bad journal location %lu+%lu\n", first, blocks);
+                return -EINVAL;
+        }
+
+        j = kmalloc(sizeof(struct lab5fs_journal), GFP_KERNEL);
+        if (!j)
+                return -ENOMEM;
+        memset(j, 0, sizeof(struct lab5fs_journal));
+        j->j_sb = sb;
+        j->j_first = first;
+        j->j_blocks = blocks;
+        init_rwsem(&j->j_barrier);
+        init_MUTEX(&j->j_commit_sem);
+        spin_lock_init(&j->j_lock);
+        INIT_LIST_HEAD(&j->j_data);
+
+        /* a full transaction, with its descriptor, revoke and commit
+         * blocks, fits in the half of the log a checkpoint keeps free. */
+        j->j_max_buffers = (blocks - 1) / 2 -
+                           2 * (lab5fs_journal_tag_blocks(blocks) + 1) - 1;
+        j->j_max_trans = j->j_max_buffers / 2;
+        if (j->j_max_trans < LAB5FS_MAX_CREDITS) {
+                printk("lab5fs: journal of %lu blocks is too small, "
+                       "a transaction needs room for %d buffers\n",
+                       blocks, LAB5FS_MAX_CREDITS);
+                goto ret_err;
+        }
+
+        j->j_bhs = kmalloc(blocks * sizeof(struct buffer_head *), GFP_KERNEL);
+        j->j_ckpt = kmalloc(blocks * sizeof(struct buffer_head *), GFP_KERNEL);
+        j->j_log = kmalloc(blocks * sizeof(struct buffer_head *), GFP_KERNEL);
+        j->j_revoke = kmalloc(blocks * sizeof(u32), GFP_KERNEL);
+        if (!j->j_bhs || !j->j_ckpt || !j->j_log || !j->j_revoke) {
+                err = -ENOMEM;
+                goto ret_err;
+        }
+
+        if (!(j->j_sbh = sb_bread(sb, first))) {
+                printk("Unable to read journal super block\n");
+                err = -EIO;
+                goto ret_err;
+        }
+        js = (struct lab5fs_journal_super *)j->j_sbh->b_data;
+        if (le32_to_cpu(js->js_header.jh_magic) != LAB5FS_JOURNAL_MAGIC ||
+            le32_to_cpu(js->js_header.jh_type) != LAB5FS_JOURNAL_SUPER ||
+            le32_to_cpu(js->js_blocks) != blocks ||
+            le32_to_cpu(js->js_start) == 0 || le32_to_cpu(js->js_start) >= blocks) {
+                printk("Bad journal super block\n");
+                goto ret_err;
+        }
+
+        err = lab5fs_journal_recover(j);
+        if (err)
+                goto ret_err;
+        j->j_free = blocks - 1;
+        j->j_committed = j->j_sequence - 1;
+        sb_info->s_journal = j;
+        return 0;
+
+  ret_err:
+        lab5fs_journal_free(j);
+        return err;
+}
+
+/* Commit and checkpoint everything at unmount, leaving the log empty. */
+void lab5fs_journal_release(struct lab5fs_sb_info *sb_info)
+{
+        struct lab5fs_journal *j = sb_info->s_journal;
+
+        if (!j)
+                return;
+        down(&j->j_commit_sem);
+        lab5fs_journal_do_commit(j);
+        down_write(&j->j_barrier);
+        lab5fs_journal_checkpoint(j);
+        up_write(&j->j_barrier);
+        up(&j->j_commit_sem);
+
+        lab5fs_journal_free(j);
+        sb_info->s_journal = NULL;
+}
@@ -0,0 +1,48 @@
+#ifndef LAB5FS_JOURNAL_H
+#define LAB5FS_JOURNAL_H
+
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+
+struct lab5fs_journal;
+struct lab5fs_sb_info;
+
+/* journal blocks a handle may dirty, by operation */
+#define LAB5FS_INODE_CREDITS 4 //inode bitmap, descriptor, inode table block, super block
+#define LAB5FS_ALLOC_CREDITS 2 //block bitmap and descriptor of one run
+#define LAB5FS_EXTENT_CREDITS (2 * LAB5FS_EXTENT_MAX_DEPTH + 1 + (LAB5FS_EXTENT_MAX_DEPTH + 1) * LAB5FS_ALLOC_CREDITS)
+#define LAB5FS_DIR_CREDITS (2 * LAB5FS_DX_MAX_LEVELS + 2 + 2 * (LAB5FS_ALLOC_CREDITS + LAB5FS_EXTENT_CREDITS))
+#define LAB5FS_CREATE_CREDITS (LAB5FS_INODE_CREDITS + LAB5FS_DIR_CREDITS + 1)
+#define LAB5FS_UNLINK_CREDITS (LAB5FS_DIR_CREDITS + 2)
+#define LAB5FS_WRITE_CREDITS (2 * LAB5FS_ALLOC_CREDITS + LAB5FS_EXTENT_CREDITS + 1)
+#define LAB5FS_TRUNCATE_STEP_CREDITS (LAB5FS_ALLOC_CREDITS + (LAB5FS_EXTENT_MAX_DEPTH + 1) * (1 + LAB5FS_ALLOC_CREDITS)) //one run and the extent blocks it empties
+#define LAB5FS_TRUNCATE_RESERVE (LAB5FS_TRUNCATE_STEP_CREDITS + 2 * LAB5FS_INODE_CREDITS) //a step, the orphan list and what the caller does after
+#define LAB5FS_TRUNCATE_CREDITS (2 * LAB5FS_TRUNCATE_RESERVE) //restarted when it runs low, see lab5fs_extent_truncate
+#define LAB5FS_MAX_CREDITS LAB5FS_CREATE_CREDITS //the largest of the above; a journal too small to grant it is refused at mount
+
+/*
+ * A handle brackets one operation: every metadata buffer it dirties
+ * commits atomically with the rest. Handles live on the caller's stack and
+ * nest - an inner start/stop pair joins the outer handle.
+ */
+struct lab5fs_handle {
+	unsigned long h_magic;
+	struct lab5fs_journal *h_journal; //NULL if the volume has no journal
+	void *h_saved; //journal_info of the task before this handle
+	int h_credits;
+	int h_used; //buffers it added to the transaction
+	int h_nested;
+};
+
+int lab5fs_journal_load(struct super_block *, struct lab5fs_sb_info *); //replays the log and sets up the journal
+void lab5fs_journal_release(struct lab5fs_sb_info *); //commits and checkpoints everything
+int lab5fs_journal_start(struct super_block *, struct lab5fs_handle *, int); //-EFBIG if one transaction cannot hold that many
+void lab5fs_journal_stop(struct lab5fs_handle *);
+int lab5fs_journal_credits(struct super_block *); //credits the current handle has left
+int lab5fs_journal_restart(struct super_block *, int); //commits the current handle's work separately and starts it over
+int lab5fs_journal_dirty(struct super_block *, struct inode *, struct buffer_head *); //replaces mark_buffer_dirty for metadata; -ENOSPC if the handle overdrew
+void lab5fs_journal_dirty_data(struct super_block *, struct buffer_head *); //a file buffer just given a new block, written before the commit
+void lab5fs_journal_forget(struct super_block *, unsigned long, unsigned long); //blocks being freed
+int lab5fs_journal_commit(struct super_block *); //commits the running transaction and waits
+
+#endif /*LAB5FS_JOURNAL_H*/
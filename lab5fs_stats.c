@@ -0,0 +1,156 @@
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/err.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/time.h>
+#include "lab5fs.h"
+#include "lab5fs_super.h"
+#include "lab5fs_stats.h"
+
+int lab5fs_debug = 0;
+module_param_named(debug, lab5fs_debug, int, 0644);
+MODULE_PARM_DESC(debug, "trace every filesystem operation to the kernel log");
+
+/* <debugfs>/lab5fs, holding one directory per mounted device */
+static struct dentry *lab5fs_debugfs_root;
+
+static const char *lab5fs_op_names[LAB5FS_OP_COUNT] = {
+	"lookup", "create", "unlink", "readdir",
+	"alloc", "free", "iread", "iwrite", "commit"
+};
+
+/* Account one call of the given operation that started at start. */
+void lab5fs_stats_end(struct super_block *sb, int op, struct timeval *start)
+{
+	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+	struct lab5fs_op_stats *st;
+	struct timeval now;
+	long usecs;
+	int bucket;
+
+	if (!sb_info || !sb_info->s_stats)
+		return;
+
+	do_gettimeofday(&now);
+	usecs = (now.tv_sec - start->tv_sec) * 1000000 +
+		(now.tv_usec - start->tv_usec);
+	if (usecs < 0) /*the clock was set back*/
+		usecs = 0;
+	bucket = fls(usecs);
+	if (bucket >= LAB5FS_HIST_BUCKETS)
+		bucket = LAB5FS_HIST_BUCKETS - 1;
+
+	st = &per_cpu_ptr(sb_info->s_stats, get_cpu())->op[op];
+	st->count++;
+	st->usecs += usecs;
+	st->hist[bucket]++;
+	put_cpu();
+}
+
+/* One line per operation: name, calls, total usecs, then the histogram. */
+static int lab5fs_stats_show(struct seq_file *m, void *v)
+{
+	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO((struct super_block *)m->private);
+	struct lab5fs_op_stats sum, *st;
+	int op, cpu, i;
+
+	seq_printf(m, "# op count usecs hist(<1us <2us <4us ...)\n");
+	for (op = 0; op < LAB5FS_OP_COUNT; op++) {
+		memset(&sum, 0, sizeof(sum));
+		for_each_cpu(cpu) {
+			st = &per_cpu_ptr(sb_info->s_stats, cpu)->op[op];
+			sum.count += st->count;
+			sum.usecs += st->usecs;
+			for (i = 0; i < LAB5FS_HIST_BUCKETS; i++)
+				sum.hist[i] += st->hist[i];
+		}
+
+		seq_printf(m, "%-8s %lu %llu", lab5fs_op_names[op],
+			   sum.count, sum.usecs);
+		for (i = 0; i < LAB5FS_HIST_BUCKETS; i++)
+			seq_printf(m, " %lu", sum.hist[i]);
+		seq_putc(m, '\n');
+	}
+	return 0;
+}
+
+static int lab5fs_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lab5fs_stats_show, inode->u.generic_ip);
+}
+
+/* Any write clears the counters, so a run can be profiled on its own. */
+static ssize_t lab5fs_stats_write(struct file *file, const char __user *buf,
+				  size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO((struct super_block *)m->private);
+	int cpu;
+
+	for_each_cpu(cpu)
+		memset(per_cpu_ptr(sb_info->s_stats, cpu), 0,
+		       sizeof(struct lab5fs_stats));
+	return count;
+}
+
+static struct file_operations lab5fs_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = lab5fs_stats_open,
+	.read = seq_read,
+	.write = lab5fs_stats_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * Allocate the per-cpu counters of a new mount and publish them in
+ * debugfs. A missing debugfs is not an error: the counters are kept anyway.
+ * returns 0 on success, a negative error code on failure.
+ */
+int lab5fs_stats_mount(struct super_block *sb, struct lab5fs_sb_info *sb_info)
+{
+	sb_info->s_stats = alloc_percpu(struct lab5fs_stats);
+	if (!sb_info->s_stats) {
+		printk("Not enough memory to allocate statistics.\n");
+		return -ENOMEM;
+	}
+
+	if (!lab5fs_debugfs_root)
+		return 0;
+	sb_info->s_debugfs_dir = debugfs_create_dir(sb->s_id, lab5fs_debugfs_root);
+	if (sb_info->s_debugfs_dir)
+		sb_info->s_debugfs_stats = debugfs_create_file("stats", 0644,
+							       sb_info->s_debugfs_dir,
+							       sb, &lab5fs_stats_fops);
+	return 0;
+}
+
+void lab5fs_stats_umount(struct lab5fs_sb_info *sb_info)
+{
+	if (sb_info->s_debugfs_stats)
+		debugfs_remove(sb_info->s_debugfs_stats);
+	if (sb_info->s_debugfs_dir)
+		debugfs_remove(sb_info->s_debugfs_dir);
+	if (sb_info->s_stats)
+		free_percpu(sb_info->s_stats);
+	sb_info->s_debugfs_stats = sb_info->s_debugfs_dir = NULL;
+	sb_info->s_stats = NULL;
+}
+
+void lab5fs_stats_init(void)
+{
+	lab5fs_debugfs_root = debugfs_create_dir("lab5fs", NULL);
+	if (IS_ERR(lab5fs_debugfs_root)) /*debugfs not built in*/
+		lab5fs_debugfs_root = NULL;
+}
+
+void lab5fs_stats_exit(void)
+{
+	if (lab5fs_debugfs_root)
+		debugfs_remove(lab5fs_debugfs_root);
+}
@@ -0,0 +1,63 @@
+#ifndef LAB5FS_STATS_H
+#define LAB5FS_STATS_H
+
+#include <linux/fs.h>
+#include <linux/time.h>
+
+struct lab5fs_sb_info;
+
+/*
+ * Tracing and profiling. Trace output is off unless the module's debug
+ * parameter is set (writable at runtime through
+ * /sys/module/lab5fs_mod/parameters/debug). Operation counts and latency
+ * histograms are always kept, per cpu, and shown in
+ * <debugfs>/lab5fs/<device>/stats; writing to that file clears them.
+ */
+extern int lab5fs_debug;
+
+#define lab5fs_dbg(fmt, args...) \
+	do { \
+		if (unlikely(lab5fs_debug)) \
+			printk(KERN_DEBUG "lab5fs: " fmt, ## args); \
+	} while (0)
+
+enum lab5fs_op {
+	LAB5FS_OP_LOOKUP,
+	LAB5FS_OP_CREATE,
+	LAB5FS_OP_UNLINK,
+	LAB5FS_OP_READDIR,
+	LAB5FS_OP_ALLOC, /*block runs*/
+	LAB5FS_OP_FREE,
+	LAB5FS_OP_IREAD,
+	LAB5FS_OP_IWRITE,
+	LAB5FS_OP_COMMIT, /*journal commits*/
+	LAB5FS_OP_COUNT
+};
+
+/* bucket 0 counts calls under 1us, bucket n those of [2^(n-1), 2^n) us */
+#define LAB5FS_HIST_BUCKETS 20
+
+struct lab5fs_op_stats {
+	unsigned long count;
+	unsigned long long usecs; //total time spent
+	unsigned long hist[LAB5FS_HIST_BUCKETS];
+};
+
+/* one cpu's share of a mount's statistics */
+struct lab5fs_stats {
+	struct lab5fs_op_stats op[LAB5FS_OP_COUNT];
+};
+
+void lab5fs_stats_init(void); //creates the debugfs root at module load
+void lab5fs_stats_exit(void);
+int lab5fs_stats_mount(struct super_block *, struct lab5fs_sb_info *); //sets up the counters of a mount
+void lab5fs_stats_umount(struct lab5fs_sb_info *);
+void lab5fs_stats_end(struct super_block *, int, struct timeval *); //accounts one call
+
+/* start timing a call; pass the same timeval to lab5fs_stats_end. */
+static inline void lab5fs_stats_start(struct timeval *start)
+{
+	do_gettimeofday(start);
+}
+
+#endif /*LAB5FS_STATS_H*/
@@ -3,114 +3,331 @@
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/percpu_counter.h>
+#include <linux/statfs.h>
+#include <linux/parser.h>
+#include <linux/seq_file.h>
 #include "lab5fs.h"
 #include "lab5fs_super.h"
 #include "lab5fs_inode.h"
+#include "lab5fs_stats.h"
+#include "lab5fs_journal.h"
 
+/*files with at least this many blocks are deleted by the orphan worker*/
+#define LAB5FS_ASYNC_DELETE_BLOCKS 64
 
-/*MACRO for accessing the superblock info pointer*/
-#define LAB5FS_SB_INFO(sb) ((struct lab5fs_sb_info*)((sb)->s_fs_info))
+/*free blocks delayed allocation leaves for the extent blocks writeback may need*/
+#define LAB5FS_META_RESERVE 64
 
 /*function prototypes for super block operations*/
-void lab5fs_read_inode (struct inode *);
-void lab5fs_clear_inode (struct inode *);
 void lab5fs_put_super (struct super_block *);
 void lab5fs_write_super (struct super_block *sb);
 void lab5fs_write_inode(struct inode *ino, int sync);
+void lab5fs_dirty_inode(struct inode *ino);
 void lab5fs_delete_inode (struct inode *ino);
+int lab5fs_statfs (struct dentry *dentry, struct kstatfs *buf);
+static void lab5fs_orphan_work(void *data);
+int lab5fs_sync_fs (struct super_block *sb, int wait);
+static int lab5fs_remount (struct super_block *sb, int *flags, char *data);
+static int lab5fs_show_options (struct seq_file *seq, struct vfsmount *vfs);
 
 /*Note: still need to actually implement these functions*/
 struct super_operations lab5fs_super_ops ={
-	read_inode: lab5fs_read_inode,
 	write_inode: lab5fs_write_inode,
-	clear_inode: lab5fs_clear_inode,
+	dirty_inode: lab5fs_dirty_inode,
+	alloc_inode: lab5fs_alloc_inode,
+	destroy_inode: lab5fs_destroy_inode,
 	delete_inode: lab5fs_delete_inode,
 	put_super: lab5fs_put_super,
 	write_super: lab5fs_write_super,
+	statfs: lab5fs_statfs,
+	sync_fs: lab5fs_sync_fs,
+	remount_fs: lab5fs_remount,
+	show_options: lab5fs_show_options,
 };
 
-/* Store custom metadata about filesystem*/
-struct lab5fs_sb_info {
-	/*lab5fs super block*/
-	struct buffer_head *s_sbh;
-        struct lab5fs_super_block *s_lab5fs_sb;
-
-	/*lab5fs block bitmap*/
-        struct buffer_head *s_block_bitmap_bh;
-        struct lab5fs_bitmap *s_lab5fs_block_bitmap;
-
-	/*lab5fs inode bitmap*/
-        struct buffer_head *s_inode_bitmap_bh;
-        struct lab5fs_bitmap *s_lab5fs_inode_bitmap;
-
-	/*lab5fs inode table*/
-	struct buffer_head *s_inode_table_bh;
-	struct lab5fs_inode_table *s_lab5fs_inode_table;
+/*
+ * In-memory state of one block group. g_lock protects the group's bitmaps
+ * and the free counts in its descriptor; allocations in different groups
+ * never contend.
+ */
+struct lab5fs_group_info {
+	spinlock_t g_lock;
+	struct buffer_head *g_block_bitmap; /*read on first use, NULL until then*/
+	struct buffer_head *g_inode_bitmap;
 };
 
+static struct lab5fs_group_desc *lab5fs_get_group_desc(struct super_block *sb,
+                                                       unsigned long group,
+                                                       struct buffer_head **bh);
 
-/*Locate the block number of an inode given its inode number*/
-unsigned long lab5fs_find_block_num(struct inode *ino)
+/*
+ * Locate an inode given its inode number: returns the inode table block
+ * holding it and stores the byte offset of its slot in offset.
+ * returns 0 if the inode number is out of range.
+ */
+unsigned long lab5fs_inode_block(struct super_block *sb, unsigned long ino_num,
+                                 unsigned long *offset)
 {
-        unsigned long ino_num = ino->i_ino;
-        unsigned long block_num = 0;
-        struct lab5fs_inode_table *inode_table;
+        struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+        struct lab5fs_group_desc *desc;
+        struct buffer_head *gbh;
+        unsigned long group, index, block_num;
 
-        if (ino_num < LAB5FS_ROOT_INODE || ino_num > LAB5FS_MAX_INODE_COUNT) {
+        if (ino_num < LAB5FS_ROOT_INODE ||
+            ino_num >= le32_to_cpu(sb_info->s_lab5fs_sb->s_inode_count)) {
              printk("inode number '%lu' is out of range\n", ino_num);
              return 0;
         }
 
-        inode_table = LAB5FS_SB_INFO(ino->i_sb)->s_lab5fs_inode_table;
-        block_num = le32_to_cpu(inode_table->inodes[ino_num]);
-        printk("inode number '%lu' is on block %lu\n", ino_num, block_num);
+        group = ino_num / LAB5FS_INODES_PER_GROUP;
+        index = ino_num % LAB5FS_INODES_PER_GROUP;
+        desc = lab5fs_get_group_desc(sb, group, &gbh);
+        block_num = le32_to_cpu(desc->bg_inode_table) + index / LAB5FS_INODES_PER_BLOCK;
+        *offset = (index % LAB5FS_INODES_PER_BLOCK) * LAB5FS_INODE_SIZE;
 
         return block_num;
 }
 
 
+/*
+ * Returns the descriptor of the given group, and the buffer holding it in bh.
+ */
+static struct lab5fs_group_desc *lab5fs_get_group_desc(struct super_block *sb,
+                                                       unsigned long group,
+                                                       struct buffer_head **bh)
+{
+        struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+        struct lab5fs_group_desc *desc;
 
+        *bh = sb_info->s_group_desc[group / LAB5FS_DESC_PER_BLOCK];
+        desc = (struct lab5fs_group_desc *)(*bh)->b_data;
+        return desc + group % LAB5FS_DESC_PER_BLOCK;
+}
 
 /*
- * Allocates a free block number.
- * returns 0 if no free numbers are available.
+ * Returns the buffer of a group's block or inode bitmap, reading it from
+ * disk the first time it is needed. slot is g_block_bitmap or
+ * g_inode_bitmap of the group. The read happens without any lock held; if
+ * two tasks race to load the same bitmap, the loser drops its copy.
+ * returns NULL if the bitmap could not be read.
  */
-int lab5fs_alloc_block_num(struct super_block *sb)
+static struct buffer_head *lab5fs_load_bitmap(struct super_block *sb,
+                                              struct lab5fs_group_info *gi,
+                                              struct buffer_head **slot,
+                                              unsigned long block_num)
+{
+        struct buffer_head *bh;
+
+        spin_lock(&gi->g_lock);
+        bh = *slot;
+        spin_unlock(&gi->g_lock);
+        if (bh)
+                return bh;
+
+        bh = sb_bread(sb, block_num);
+        if (!bh) {
+                printk("Unable to read bitmap block %lu\n", block_num);
+                return NULL;
+        }
+
+        spin_lock(&gi->g_lock);
+        if (!*slot) {
+                *slot = bh;
+                bh = NULL;
+        }
+        spin_unlock(&gi->g_lock);
+        if (bh)
+                brelse(bh);
+        return *slot;
+}
+
+static struct buffer_head *lab5fs_block_bitmap(struct super_block *sb,
+                                               unsigned long group)
+{
+        struct lab5fs_group_info *gi = &LAB5FS_SB_INFO(sb)->s_group_info[group];
+        struct buffer_head *gbh;
+        struct lab5fs_group_desc *desc = lab5fs_get_group_desc(sb, group, &gbh);
+
+        return lab5fs_load_bitmap(sb, gi, &gi->g_block_bitmap,
+                                  le32_to_cpu(desc->bg_block_bitmap));
+}
+
+static struct buffer_head *lab5fs_inode_bitmap(struct super_block *sb,
+                                               unsigned long group)
+{
+        struct lab5fs_group_info *gi = &LAB5FS_SB_INFO(sb)->s_group_info[group];
+        struct buffer_head *gbh;
+        struct lab5fs_group_desc *desc = lab5fs_get_group_desc(sb, group, &gbh);
+
+        return lab5fs_load_bitmap(sb, gi, &gi->g_inode_bitmap,
+                                  le32_to_cpu(desc->bg_inode_bitmap));
+}
+
+/*
+ * Looks for a run of free bits in a group's bitmap at or after offset.
+ * Returns the first run at least want bits long; failing that, the longest
+ * run found. The run length is stored in len (0 if the range is full).
+ */
+static unsigned long lab5fs_find_run(unsigned long *map, unsigned long offset,
+                                     unsigned long want, unsigned long *len)
+{
+        unsigned long start, end, best = 0;
+
+        *len = 0;
+        while (offset < LAB5FS_BLOCKS_PER_GROUP) {
+                start = find_next_zero_bit(map, LAB5FS_BLOCKS_PER_GROUP, offset);
+                if (start >= LAB5FS_BLOCKS_PER_GROUP)
+                        break;
+                end = find_next_bit(map, LAB5FS_BLOCKS_PER_GROUP, start);
+                if (end - start > *len) {
+                        best = start;
+                        *len = end - start;
+                        if (*len >= want)
+                                break;
+                }
+                offset = end;
+        }
+        return best;
+}
+
+/*
+ * Tries to allocate a run of want blocks in the given group, searching from
+ * offset. If the group has no run that long, nothing is allocated unless
+ * take_any is set, in which case the longest run is taken (up to want).
+ * *len is set to the length found.
+ * returns the first block of the run (relative to the group) if one was
+ * allocated, -1 otherwise.
+ */
+static long lab5fs_grab_run(struct super_block *sb, unsigned long group,
+                            unsigned long offset, unsigned long want,
+                            int take_any, unsigned long *len)
+{
+        struct lab5fs_group_info *gi = &LAB5FS_SB_INFO(sb)->s_group_info[group];
+        struct buffer_head *bbh, *gbh;
+        struct lab5fs_group_desc *desc;
+        unsigned long start, i;
+
+        *len = 0;
+        bbh = lab5fs_block_bitmap(sb, group);
+        if (!bbh)
+                return -1;
+        desc = lab5fs_get_group_desc(sb, group, &gbh);
+
+        spin_lock(&gi->g_lock);
+        start = lab5fs_find_run((unsigned long*)bbh->b_data, offset, want, len);
+        if (*len == 0 || (*len < want && !take_any)) {
+                spin_unlock(&gi->g_lock);
+                return -1;
+        }
+        if (*len > want)
+                *len = want;
+        for (i = start; i < start + *len; i++)
+                set_bit(i, (unsigned long*)bbh->b_data);
+        desc->bg_free_blocks_count =
+                cpu_to_le32(le32_to_cpu(desc->bg_free_blocks_count) - *len);
+        spin_unlock(&gi->g_lock);
+
+        lab5fs_journal_dirty(sb, NULL, bbh);
+        lab5fs_journal_dirty(sb, NULL, gbh);
+        return start;
+}
+
+
+/*
+ * Allocates a run of up to *count contiguous free blocks.
+ * The search starts at goal if it is a usable block number, otherwise at
+ * the superblock's next-fit cursor. It moves through the groups from there,
+ * skipping full groups without reading their bitmaps, and wraps around
+ * once. The first free run that is long enough is taken; failing that, the
+ * longest run seen. *count is set to the length actually allocated.
+ * Only the group being searched is locked.
+ * returns the first block of the run, or 0 if no blocks are available.
+ */
+int lab5fs_new_blocks(struct super_block *sb, unsigned long goal, int *count)
 {
         struct lab5fs_sb_info* sb_info = LAB5FS_SB_INFO(sb);
         struct lab5fs_super_block* lab5fs_sb = sb_info->s_lab5fs_sb;
-	struct lab5fs_bitmap *block_bitmap = sb_info->s_lab5fs_block_bitmap;
-        struct buffer_head *sbh = sb_info->s_sbh;
-        struct buffer_head *bbh = sb_info->s_block_bitmap_bh;
-        int block_num = 0;
+        struct buffer_head *gbh;
+        struct lab5fs_group_desc *desc;
+        unsigned long first = LAB5FS_GDT_FIRST_NUM;
+        unsigned long group, offset, len, i;
+        unsigned long best_len = 0, best_group = 0;
+        long start = -1;
+        int want = *count;
+        struct timeval op_start;
+
+        *count = 0;
+        if (want <= 0)
+                return 0;
+
+        lab5fs_stats_start(&op_start);
+        if (percpu_counter_read_positive(&sb_info->s_freeblocks_counter) == 0) {
+                printk("Error: no more free blocks.\n");
+                goto ret;
+        }
 
-        printk("allocating block\n");
+        if (goal < first || goal >= lab5fs_sb->s_blocks_count)
+                goal = sb_info->s_next_block;
+        if (goal < first || goal >= lab5fs_sb->s_blocks_count)
+                goal = first;
+
+        group = goal / LAB5FS_BLOCKS_PER_GROUP;
+        offset = goal % LAB5FS_BLOCKS_PER_GROUP;
+
+        /* one extra pass so the goal group is also searched below the goal. */
+        for (i = 0; i <= sb_info->s_groups_count; i++) {
+                desc = lab5fs_get_group_desc(sb, group, &gbh);
+                if (le32_to_cpu(desc->bg_free_blocks_count) > best_len) {
+                        start = lab5fs_grab_run(sb, group, offset, want, 0, &len);
+                        if (start >= 0)
+                                break;
+                        if (len > best_len) {
+                                best_len = len;
+                                best_group = group;
+                        }
+                }
+                offset = 0;
+                if (++group >= sb_info->s_groups_count)
+                        group = 0;
+        }
 
-        lock_super(sb);
+        /* no run was long enough: settle for the longest one seen, which
+         * another task may have shrunk in the meantime. */
+        if (start < 0 && best_len > 0) {
+                group = best_group;
+                start = lab5fs_grab_run(sb, group, 0, want, 1, &len);
+        }
 
-        if (lab5fs_sb->s_free_blocks_count == 0) {
-                printk("Error: no more free blocks.\n");
+        if (start < 0) {
+                printk("Error: Could not find free block.\n");
                 goto ret;
         }
-	
-		/*go to bitmap for first free block*/
-		block_num = find_first_zero_bit((unsigned long*)(block_bitmap->map),LAB5FS_MAX_BLOCK_COUNT);
-		if(block_num >= LAB5FS_MAX_BLOCK_COUNT || block_num<=LAB5FS_ROOT_DATA_FIRST_NUM){
-			printk("Error: Could not find free block. Block num=%d.\n",block_num);
-			block_num=0;
-            goto ret;
-		}
-		set_bit(block_num, (unsigned long*)(block_bitmap->map));
-        lab5fs_sb->s_free_blocks_count--;
-		mark_buffer_dirty(bbh);
-        mark_buffer_dirty(sbh);
+
+        percpu_counter_mod(&sb_info->s_freeblocks_counter, -(long)len);
+        start += group * LAB5FS_BLOCKS_PER_GROUP;
+        sb_info->s_next_block = start + len;
+        *count = len;
         sb->s_dirt = 1;
 
-        printk("Allocated block number %d\n", block_num);
+        lab5fs_dbg("Allocated blocks %lu-%lu\n", start, start + len - 1);
 
-ret:
-        unlock_super(sb);
-        return block_num;
+  ret:
+        lab5fs_stats_end(sb, LAB5FS_OP_ALLOC, &op_start);
+        return start < 0 ? 0 : start;
+}
+
+
+/*
+ * Allocates a single free block number at the next-fit cursor.
+ * returns 0 if no free numbers are available.
+ */
+int lab5fs_alloc_block_num(struct super_block *sb)
+{
+        int count = 1;
+
+        return lab5fs_new_blocks(sb, 0, &count);
 }
 
 
@@ -120,93 +337,174 @@ ret:
  */
 int lab5fs_release_block_num(struct super_block *sb, int block_num)
 {
-        struct lab5fs_sb_info* sb_info = LAB5FS_SB_INFO(sb);
-        struct lab5fs_super_block* lab5fs_sb = sb_info->s_lab5fs_sb;
-		struct lab5fs_bitmap* block_bitmap = sb_info->s_lab5fs_block_bitmap;
-        struct buffer_head *sbh = sb_info->s_sbh;
-        struct buffer_head *bbh = sb_info->s_block_bitmap_bh;
+        return lab5fs_release_block_range(sb, block_num, 1);
+}
 
-        printk("freeing block %d\n",block_num);
 
-        /* Prevent freeing any of the low number blocks. */
-        if (block_num <= LAB5FS_ROOT_DATA_FIRST_NUM) {
-                printk("trying to free at or below "
-                       "mandatory block %d\n",
-                       LAB5FS_ROOT_DATA_FIRST_NUM);
-				return -1;
+/*
+ * Frees a run of count previously allocated blocks starting at block_num.
+ * The run may cross group boundaries; each group's lock is taken once.
+ * returns 0 on success, a negative error code on failure.
+ */
+int lab5fs_release_block_range(struct super_block *sb, int block_num, int count)
+{
+        struct lab5fs_sb_info* sb_info = LAB5FS_SB_INFO(sb);
+        struct lab5fs_super_block* lab5fs_sb = sb_info->s_lab5fs_sb;
+        struct lab5fs_group_info *gi;
+        struct buffer_head *bbh, *gbh;
+        struct lab5fs_group_desc *desc;
+        unsigned long group, bit, n, freed, i;
+        int err = 0;
+        struct timeval op_start;
+
+        lab5fs_dbg("freeing blocks %d-%d\n", block_num, block_num + count - 1);
+
+        /* Prevent freeing any of the low number blocks or running off the disk. */
+        if (block_num < LAB5FS_GDT_FIRST_NUM ||
+            count <= 0 || block_num + count > lab5fs_sb->s_blocks_count) {
+                printk("trying to free invalid block range %d+%d\n",
+                       block_num, count);
+                return -1;
         }
-		
-		/*check block number is less than max block number*/
-		if(block_num >= LAB5FS_MAX_BLOCK_COUNT){
-			printk("trying to free a block with block number" 
-					"greater than maximum block number %d\n",
-					LAB5FS_MAX_BLOCK_COUNT);
-				return -1;
-		}
 
-        lock_super(sb);
+        lab5fs_stats_start(&op_start);
+        lab5fs_journal_forget(sb, block_num, count);
+        while (count > 0) {
+                group = block_num / LAB5FS_BLOCKS_PER_GROUP;
+                bit = block_num % LAB5FS_BLOCKS_PER_GROUP;
+                n = LAB5FS_BLOCKS_PER_GROUP - bit;
+                if (n > count)
+                        n = count;
+
+                bbh = lab5fs_block_bitmap(sb, group);
+                if (!bbh) {
+                        err = -EIO;
+                        break;
+                }
+                gi = &sb_info->s_group_info[group];
+                desc = lab5fs_get_group_desc(sb, group, &gbh);
+
+                /*clear bitmap*/
+                freed = 0;
+                spin_lock(&gi->g_lock);
+                for (i = bit; i < bit + n; i++) {
+                        if (test_and_clear_bit(i, (unsigned long*)bbh->b_data))
+                                freed++;
+                }
+                desc->bg_free_blocks_count =
+                        cpu_to_le32(le32_to_cpu(desc->bg_free_blocks_count) + freed);
+                spin_unlock(&gi->g_lock);
+
+                if (freed != n)
+                        printk("%lu blocks of %d-%lu were already free\n",
+                               n - freed, block_num, block_num + n - 1);
+                percpu_counter_mod(&sb_info->s_freeblocks_counter, freed);
+                lab5fs_journal_dirty(sb, NULL, bbh);
+                lab5fs_journal_dirty(sb, NULL, gbh);
+
+                block_num += n;
+                count -= n;
+        }
 
-		/*clear bitmap*/
-		clear_bit(block_num, (unsigned long*)(block_bitmap->map));
-		
-		mark_buffer_dirty(bbh);
-        lab5fs_sb->s_free_blocks_count++;
-        mark_buffer_dirty(sbh);
         sb->s_dirt = 1;
 
-        unlock_super(sb);
-
-        printk("block %d freed\n", block_num);
+        lab5fs_stats_end(sb, LAB5FS_OP_FREE, &op_start);
+        return err;
+}
 
+/*
+ * Sets count free blocks aside for buffered writes whose blocks are only
+ * allocated at writeback (delayed allocation). Nothing is taken from the
+ * bitmaps; the blocks just stop counting as available. The per-cpu counts
+ * are only added up exactly once space is getting short.
+ * returns 0 on success, -ENOSPC if the free blocks are all spoken for.
+ */
+int lab5fs_reserve_blocks(struct super_block *sb, long count)
+{
+        struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+        long free, dirty;
+
+        free = percpu_counter_read_positive(&sb_info->s_freeblocks_counter);
+        dirty = percpu_counter_read_positive(&sb_info->s_dirtyblocks_counter);
+        if (free - dirty < count + LAB5FS_META_RESERVE +
+                           2 * FBC_BATCH * num_online_cpus()) {
+                free = percpu_counter_sum(&sb_info->s_freeblocks_counter);
+                dirty = percpu_counter_sum(&sb_info->s_dirtyblocks_counter);
+                if (free - dirty < count + LAB5FS_META_RESERVE)
+                        return -ENOSPC;
+        }
+        percpu_counter_mod(&sb_info->s_dirtyblocks_counter, count);
         return 0;
 }
 
+/* Drop a reservation, once its blocks are allocated or no longer needed. */
+void lab5fs_release_reservation(struct super_block *sb, long count)
+{
+        percpu_counter_mod(&LAB5FS_SB_INFO(sb)->s_dirtyblocks_counter, -count);
+}
+
 
 /*
- * Allocates a free inode number and creates an entry for it in the inode table.
- * The block_num parameter indicates where the inode number should be mapped to.
+ * Allocates a free inode number. Its slot in the group's inode table is
+ * found by lab5fs_inode_block.
  * returns 0 if no free numbers are available.
  */
-int lab5fs_alloc_inode_num(struct super_block *sb, int block_num)
+int lab5fs_alloc_inode_num(struct super_block *sb)
 {
 		struct lab5fs_sb_info* sb_info = LAB5FS_SB_INFO(sb);
-        struct lab5fs_super_block* lab5fs_sb = sb_info->s_lab5fs_sb;
-		struct lab5fs_bitmap* inode_bitmap = sb_info->s_lab5fs_inode_bitmap;
-		struct lab5fs_inode_table* inode_table = sb_info->s_lab5fs_inode_table;
-        struct buffer_head *sbh = sb_info->s_sbh;
-        struct buffer_head *ibh = sb_info->s_inode_bitmap_bh;
-        struct buffer_head *ith = sb_info->s_inode_table_bh;
-        int inode_num = 0;
-
-        printk("allocating inode to block %d\n",block_num);
+        struct buffer_head *ibh, *gbh;
+        struct lab5fs_group_info *gi;
+        struct lab5fs_group_desc *desc;
+        unsigned long group;
+        int inode_num = 0, bit;
 
-        lock_super(sb);
+        lab5fs_dbg("allocating inode\n");
 
-        if (lab5fs_sb->s_free_inodes_count == 0) {
+        if (percpu_counter_read_positive(&sb_info->s_freeinodes_counter) == 0) {
                 printk("Error: no more free inodes.\n");
-                goto ret;
+                return 0;
         }
-	
-		/*go to bitmap for first free inode*/
-		inode_num = find_first_zero_bit((unsigned long*)(inode_bitmap->map),LAB5FS_MAX_INODE_COUNT);
-		if(inode_num >= LAB5FS_MAX_INODE_COUNT || inode_num <= LAB5FS_ROOT_INODE){
-			printk("Error: Could not find free inode. Inode num=%d.\n",inode_num);
-			inode_num=0;
-            goto ret;
+
+		/*take the first free inode of the first group that has one,
+		 *skipping full groups without reading their bitmaps*/
+		for (group = 0; group < sb_info->s_groups_count; group++) {
+			desc = lab5fs_get_group_desc(sb, group, &gbh);
+			if (le32_to_cpu(desc->bg_free_inodes_count) == 0)
+				continue;
+			ibh = lab5fs_inode_bitmap(sb, group);
+			if (!ibh)
+				continue;
+			gi = &sb_info->s_group_info[group];
+
+			spin_lock(&gi->g_lock);
+			bit = find_first_zero_bit((unsigned long*)ibh->b_data, LAB5FS_INODES_PER_GROUP);
+			if (bit >= LAB5FS_INODES_PER_GROUP) {
+				spin_unlock(&gi->g_lock);
+				continue;
+			}
+			inode_num = group * LAB5FS_INODES_PER_GROUP + bit;
+			if (inode_num <= LAB5FS_ROOT_INODE) {
+				spin_unlock(&gi->g_lock);
+				printk("Error: Could not find free inode. Inode num=%d.\n",inode_num);
+				return 0;
+			}
+			set_bit(bit, (unsigned long*)ibh->b_data);
+			desc->bg_free_inodes_count =
+				cpu_to_le32(le32_to_cpu(desc->bg_free_inodes_count) - 1);
+			spin_unlock(&gi->g_lock);
+			goto got;
 		}
-		set_bit(inode_num, (unsigned long*)(inode_bitmap->map));
-		inode_table->inodes[inode_num]=block_num;
-		
-        lab5fs_sb->s_free_inodes_count--;
-		mark_buffer_dirty(ith);
-		mark_buffer_dirty(ibh);
-        mark_buffer_dirty(sbh);
+		printk("Error: no more free inodes.\n");
+		return 0;
+
+got:
+		percpu_counter_mod(&sb_info->s_freeinodes_counter, -1);
+		lab5fs_journal_dirty(sb, NULL, ibh);
+		lab5fs_journal_dirty(sb, NULL, gbh);
         sb->s_dirt = 1;
 
-        printk("Allocated inode number %d\n", inode_num);
+        lab5fs_dbg("Allocated inode number %d\n", inode_num);
 
-ret:
-        unlock_super(sb);
         return inode_num;
 }
 
@@ -218,102 +516,266 @@ int lab5fs_release_inode_num(struct super_block *sb, int inode_num)
 {
         struct lab5fs_sb_info* sb_info = LAB5FS_SB_INFO(sb);
         struct lab5fs_super_block* lab5fs_sb = sb_info->s_lab5fs_sb;
-	struct lab5fs_bitmap* inode_bitmap = sb_info->s_lab5fs_inode_bitmap;
-	struct lab5fs_inode_table* inode_table = sb_info->s_lab5fs_inode_table;
-        struct buffer_head *sbh = sb_info->s_sbh;
-        struct buffer_head *ibh = sb_info->s_inode_bitmap_bh;
-        struct buffer_head *ith = sb_info->s_inode_table_bh;
+        struct buffer_head *ibh, *gbh;
+        struct lab5fs_group_info *gi;
+        struct lab5fs_group_desc *desc;
+        unsigned long group = inode_num / LAB5FS_INODES_PER_GROUP;
+        int was_set;
 
 
-        printk("freeing inode %d\n",inode_num);
+        lab5fs_dbg("freeing inode %d\n",inode_num);
 
         /* Prevent freeing root inode. */
-        if (inode_num == 0) {
+        if (inode_num <= LAB5FS_ROOT_INODE) {
                 printk("trying to free root inode %d\n",
-                       LAB5FS_ROOT_DATA_FIRST_NUM);
+                       LAB5FS_ROOT_INODE);
 				return -1;
         }
 		
-		/*check block number is less than max block number*/
-		if(inode_num >= LAB5FS_MAX_INODE_COUNT){
+		/*check inode number is less than max inode number*/
+		if(inode_num >= lab5fs_sb->s_inode_count){
 			printk("trying to free a inode with inode number" 
 					"greater than max inode number %d\n",
-					LAB5FS_MAX_INODE_COUNT);
+					lab5fs_sb->s_inode_count);
 				return -1;
 		}
 
-        lock_super(sb);
+		ibh = lab5fs_inode_bitmap(sb, group);
+		if (!ibh)
+			return -EIO;
+		gi = &sb_info->s_group_info[group];
+		desc = lab5fs_get_group_desc(sb, group, &gbh);
 
 		/*clear bitmap*/
-		clear_bit(inode_num, (unsigned long*)(inode_bitmap->map));
-		/*for cleanliness set inode table entry to 0*/
-		inode_table->inodes[inode_num]=0;
-		
-		mark_buffer_dirty(ith);
-		mark_buffer_dirty(ibh);
-        lab5fs_sb->s_free_blocks_count++;
-        mark_buffer_dirty(sbh);
-        sb->s_dirt = 1;
+		spin_lock(&gi->g_lock);
+		was_set = test_and_clear_bit(inode_num % LAB5FS_INODES_PER_GROUP,
+					     (unsigned long*)ibh->b_data);
+		if (was_set)
+			desc->bg_free_inodes_count =
+				cpu_to_le32(le32_to_cpu(desc->bg_free_inodes_count) + 1);
+		spin_unlock(&gi->g_lock);
+
+		if (!was_set) {
+			printk("inode num %d was already free\n", inode_num);
+			return 0;
+		}
 
-        unlock_super(sb);
+		percpu_counter_mod(&sb_info->s_freeinodes_counter, 1);
+		lab5fs_journal_dirty(sb, NULL, ibh);
+		lab5fs_journal_dirty(sb, NULL, gbh);
+        sb->s_dirt = 1;
 
-        printk("inode num %d freed\n", inode_num);
+        lab5fs_dbg("inode num %d freed\n", inode_num);
 
         return 0;
 }
 
 
+/*Release the group descriptor table and any bitmaps read so far*/
+static void lab5fs_put_groups(struct lab5fs_sb_info *sb_info)
+{
+	unsigned long i;
+
+	if (sb_info->s_group_desc) {
+		for (i = 0; i < sb_info->s_gdt_blocks; i++)
+			brelse(sb_info->s_group_desc[i]);
+		kfree(sb_info->s_group_desc);
+	}
+	if (sb_info->s_group_info) {
+		for (i = 0; i < sb_info->s_groups_count; i++) {
+			brelse(sb_info->s_group_info[i].g_block_bitmap);
+			brelse(sb_info->s_group_info[i].g_inode_bitmap);
+		}
+		kfree(sb_info->s_group_info);
+	}
+}
+
+/*
+ * Read the group descriptor table. The bitmaps themselves are left on disk
+ * until an allocation needs them, so mounting costs s_gdt_blocks reads
+ * however large the volume is. The free counters are seeded from the
+ * descriptors.
+ * returns 0 on success, a negative error code on failure.
+ */
+static int lab5fs_load_groups(struct super_block *sb, struct lab5fs_sb_info *sb_info)
+{
+	struct lab5fs_super_block *disk_sb = sb_info->s_lab5fs_sb;
+	struct lab5fs_group_desc *desc;
+	struct buffer_head *gbh;
+	unsigned long i, free_blocks = 0, free_inodes = 0;
+
+	sb_info->s_groups_count = le32_to_cpu(disk_sb->s_groups_count);
+	sb_info->s_gdt_blocks = le32_to_cpu(disk_sb->s_gdt_blocks);
+	if (le32_to_cpu(disk_sb->s_blocks_per_group) != LAB5FS_BLOCKS_PER_GROUP ||
+	    le32_to_cpu(disk_sb->s_inodes_per_group) != LAB5FS_INODES_PER_GROUP ||
+	    le32_to_cpu(disk_sb->s_inode_size) != LAB5FS_INODE_SIZE ||
+	    sb_info->s_groups_count == 0 ||
+	    sb_info->s_gdt_blocks != (sb_info->s_groups_count + LAB5FS_DESC_PER_BLOCK - 1) / LAB5FS_DESC_PER_BLOCK) {
+		printk("Bad group layout: %lu groups in %lu descriptor blocks\n",
+		       sb_info->s_groups_count, sb_info->s_gdt_blocks);
+		return -EINVAL;
+	}
+
+	sb_info->s_group_desc = kmalloc(sb_info->s_gdt_blocks * sizeof(struct buffer_head *),
+					GFP_KERNEL);
+	sb_info->s_group_info = kmalloc(sb_info->s_groups_count * sizeof(struct lab5fs_group_info),
+					GFP_KERNEL);
+	if (!sb_info->s_group_desc || !sb_info->s_group_info) {
+		printk("Not enough memory to allocate group tables.\n");
+		return -ENOMEM;
+	}
+	memset(sb_info->s_group_desc, 0, sb_info->s_gdt_blocks * sizeof(struct buffer_head *));
+	memset(sb_info->s_group_info, 0, sb_info->s_groups_count * sizeof(struct lab5fs_group_info));
+	for (i = 0; i < sb_info->s_groups_count; i++)
+		spin_lock_init(&sb_info->s_group_info[i].g_lock);
+
+	for (i = 0; i < sb_info->s_gdt_blocks; i++) {
+		sb_info->s_group_desc[i] = sb_bread(sb, LAB5FS_GDT_FIRST_NUM + i);
+		if (!sb_info->s_group_desc[i]) {
+			printk("Unable to read group descriptor block %lu\n", i);
+			return -EIO;
+		}
+	}
+
+	for (i = 0; i < sb_info->s_groups_count; i++) {
+		gbh = sb_info->s_group_desc[i / LAB5FS_DESC_PER_BLOCK];
+		desc = (struct lab5fs_group_desc *)gbh->b_data + i % LAB5FS_DESC_PER_BLOCK;
+		free_blocks += le32_to_cpu(desc->bg_free_blocks_count);
+		free_inodes += le32_to_cpu(desc->bg_free_inodes_count);
+	}
+	percpu_counter_mod(&sb_info->s_freeblocks_counter, free_blocks);
+	percpu_counter_mod(&sb_info->s_freeinodes_counter, free_inodes);
+	return 0;
+}
+
+enum { Opt_sparse, Opt_nosparse, Opt_err };
+
+static match_table_t lab5fs_tokens = {
+	{Opt_sparse, "sparse"},
+	{Opt_nosparse, "nosparse"},
+	{Opt_err, NULL}
+};
+
+/*
+ * Parse a comma-separated mount option string into sb_info->s_mount_opt.
+ * returns 0 on success, -EINVAL for an unknown option.
+ */
+static int lab5fs_parse_options(char *options, struct lab5fs_sb_info *sb_info)
+{
+	substring_t args[MAX_OPT_ARGS];
+	char *p;
+
+	if (!options)
+		return 0;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+		switch (match_token(p, lab5fs_tokens, args)) {
+		case Opt_sparse:
+			sb_info->s_mount_opt |= LAB5FS_MOUNT_SPARSE;
+			break;
+		case Opt_nosparse:
+			sb_info->s_mount_opt &= ~LAB5FS_MOUNT_SPARSE;
+			break;
+		default:
+			printk("lab5fs: unknown mount option \"%s\"\n", p);
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
+
+static int lab5fs_remount (struct super_block *sb, int *flags, char *data)
+{
+	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+	unsigned long old_opt = sb_info->s_mount_opt;
+	int err;
+
+	err = lab5fs_parse_options(data, sb_info);
+	if (err)
+		sb_info->s_mount_opt = old_opt;
+	return err;
+}
+
+static int lab5fs_show_options (struct seq_file *seq, struct vfsmount *vfs)
+{
+	if (LAB5FS_TEST_OPT(vfs->mnt_sb, SPARSE))
+		seq_puts(seq, ",sparse");
+	return 0;
+}
 
 /* Fill in vfs superblock from lab5fs image*/
 int lab5fs_fill_super(struct super_block *sb, void *data, int silent)
 {
-	struct buffer_head *bh,*bb_bh,*ib_bh,*it_bh;
+	struct buffer_head *bh;
 	struct lab5fs_super_block *disk_sb;
-	struct lab5fs_bitmap *disk_block_bitmap;
-	struct lab5fs_bitmap *disk_inode_bitmap;
-	struct lab5fs_inode_table *disk_inode_table;
 	struct inode *inode;
-	struct lab5fs_sb_info *metadata;
+	struct lab5fs_sb_info *metadata = NULL;
+	int err = -EIO;
 	printk("Mounting lab5fs\n");
 
 	/*init buffer heads and read data from disk*/
 	sb_set_blocksize(sb, LAB5FS_BLOCK_SIZE);
-	bh = sb_bread(sb, 0);
+	if(!(bh = sb_bread(sb, 0))){
+		printk("Unable to read super block\n");
+		return -EIO;
+	}
 	disk_sb = (struct lab5fs_super_block*)bh->b_data;
 	printk("magic: %0x, free: %0x\n", disk_sb->s_magic, disk_sb->s_free_blocks_count);
-
-	if(!(bb_bh = sb_bread(sb, LAB5FS_BLOCK_BITMAP_NUM))){
-		printk("Unable to read block bitmap\n");
-	}
-	disk_block_bitmap = (struct lab5fs_bitmap*)bb_bh->b_data;
-
-	if(!(ib_bh = sb_bread(sb, LAB5FS_INODE_BITMAP_NUM))){
-		printk("Unable to read inode bitmap");
-	}
-	disk_inode_bitmap = (struct lab5fs_bitmap*) ib_bh->b_data;
-
-	if(!(it_bh = sb_bread(sb, LAB5FS_INODE_TABLE_NUM))){
-		printk("Unable to read inode table");
+	if(disk_sb->s_magic != LAB5FS_SUPER_MAGIC){
+		if(!silent)
+			printk("Not a lab5fs volume\n");
+		err = -EINVAL;
+		goto ret_err;
 	}
-	disk_inode_table = (struct lab5fs_inode_table*) it_bh->b_data;
 
 	/* set up superblock meta data*/
 	metadata = kmalloc(sizeof(struct lab5fs_sb_info), GFP_KERNEL);
 	if(metadata == NULL)
 	{
 		printk("Not enough memory to allocate super block struct.\n");
+		err = -ENOMEM;
+		goto ret_err;
 	}
+	memset(metadata, 0, sizeof(struct lab5fs_sb_info));
 	metadata->s_sbh = bh;
 	metadata->s_lab5fs_sb = disk_sb;
-	metadata->s_block_bitmap_bh = bb_bh;
-	metadata->s_lab5fs_block_bitmap = disk_block_bitmap;
-	metadata->s_inode_bitmap_bh = ib_bh;
-	metadata->s_lab5fs_inode_bitmap = disk_inode_bitmap;
-	metadata->s_inode_table_bh = it_bh;
-	metadata->s_lab5fs_inode_table = disk_inode_table;
+	metadata->s_next_block = LAB5FS_GDT_FIRST_NUM;
+	init_MUTEX(&metadata->s_orphan_sem);
+	INIT_WORK(&metadata->s_orphan_work, lab5fs_orphan_work, sb);
+	percpu_counter_init(&metadata->s_freeblocks_counter);
+	percpu_counter_init(&metadata->s_freeinodes_counter);
+	percpu_counter_init(&metadata->s_dirtyblocks_counter);
+
+	err = lab5fs_parse_options(data, metadata);
+	if(err)
+		goto ret_err;
+
+	/*replay the journal before reading anything it may rewrite*/
+	err = lab5fs_journal_load(sb, metadata);
+	if(err)
+		goto ret_err;
+
+	err = lab5fs_load_groups(sb, metadata);
+	if(err)
+		goto ret_err;
+
+	err = lab5fs_stats_mount(sb, metadata);
+	if(err)
+		goto ret_err;
+
+	metadata->s_orphan_wq = create_singlethread_workqueue("lab5fs_orphan");
+	if(!metadata->s_orphan_wq){
+		err = -ENOMEM;
+		goto ret_err;
+	}
 
 	/*fill vfs super block*/
+	/*the page cache cannot index past MAX_LFS_FILESIZE on 32-bit hosts*/
 	sb->s_maxbytes = LAB5FS_MAX_SIZE;
+	if (sb->s_maxbytes > MAX_LFS_FILESIZE)
+		sb->s_maxbytes = MAX_LFS_FILESIZE;
 	sb->s_blocksize = LAB5FS_BLOCK_SIZE;
 	sb->s_blocksize_bits = LAB5FS_BITS;
 	sb->s_magic = LAB5FS_SUPER_MAGIC;
@@ -321,31 +783,98 @@ int lab5fs_fill_super(struct super_block *sb, void *data, int silent)
 	sb->s_fs_info = metadata;
 
 	/*load root inode*/
-	inode = iget(sb,LAB5FS_ROOT_INODE);
+	inode = lab5fs_iget(sb,LAB5FS_ROOT_INODE);
+	if(IS_ERR(inode)){
+		printk("Unable to load root inode\n");
+		sb->s_fs_info = NULL;
+		err = PTR_ERR(inode);
+		goto ret_err;
+	}
 	sb->s_root = d_alloc_root(inode);
+	if(!sb->s_root){
+		printk("Unable to load root inode\n");
+		iput(inode);
+		sb->s_fs_info = NULL;
+		err = -EIO;
+		goto ret_err;
+	}
+
+	/*finish deletions interrupted by a crash*/
+	if(le32_to_cpu(disk_sb->s_last_orphan) && !(sb->s_flags & MS_RDONLY))
+		queue_work(metadata->s_orphan_wq, &metadata->s_orphan_work);
 
 	return 0;
+
+ret_err:
+	if(metadata){
+		if(metadata->s_orphan_wq)
+			destroy_workqueue(metadata->s_orphan_wq);
+		lab5fs_stats_umount(metadata);
+		lab5fs_journal_release(metadata);
+		lab5fs_put_groups(metadata);
+		percpu_counter_destroy(&metadata->s_freeblocks_counter);
+		percpu_counter_destroy(&metadata->s_freeinodes_counter);
+		percpu_counter_destroy(&metadata->s_dirtyblocks_counter);
+		kfree(metadata);
+	}
+	brelse(bh);
+	return err;
 }
 
-void lab5fs_read_inode (struct inode *ino)
+/*
+ * Get the in-core inode for ino_num, reading it from its inode table slot
+ * if it is not cached yet. Other lookups of the same inode wait on I_NEW
+ * until it is filled in.
+ * returns the inode, or an ERR_PTR on failure.
+ */
+struct inode *lab5fs_iget (struct super_block *sb, unsigned long ino_num)
 {
-        unsigned long block_num = 0;
-
-        /* find the inode's block number. */
-        block_num = lab5fs_find_block_num(ino);
-        if (block_num == 0)
+        struct inode *ino;
+        unsigned long block_num = 0, offset = 0;
+        struct timeval op_start;
+        int err;
+
+        ino = iget_locked(sb, ino_num);
+        if (!ino)
+                return ERR_PTR(-ENOMEM);
+        if (!(ino->i_state & I_NEW))
+                return ino;
+
+        lab5fs_stats_start(&op_start);
+
+        /* find the inode table block and slot holding the inode. */
+        block_num = lab5fs_inode_block(sb, ino_num, &offset);
+        if (block_num == 0) {
 		printk("Error reading inode\n");
-        lab5fs_inode_read_ino(ino, block_num); /*function defined in lab5fs_inode.c*/
+		err = -EIO;
+	} else
+		err = lab5fs_inode_read_ino(ino, block_num, offset); /*function defined in lab5fs_inode.c*/
+
+        lab5fs_stats_end(sb, LAB5FS_OP_IREAD, &op_start);
+
+        if (err) {
+                make_bad_inode(ino);
+                unlock_new_inode(ino);
+                iput(ino);
+                return ERR_PTR(err);
+        }
+        unlock_new_inode(ino);
+        return ino;
 }
 
 /*Free bufferheads and release memory*/
 void lab5fs_put_super(struct super_block *sb){
 	struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
 	printk("Releasing VFS super block\n");
+	destroy_workqueue(sb_info->s_orphan_wq);
+	lab5fs_write_super(sb);
+	lab5fs_journal_release(sb_info);
+	lab5fs_stats_umount(sb_info);
+	lab5fs_put_groups(sb_info);
+	percpu_counter_destroy(&sb_info->s_freeblocks_counter);
+	percpu_counter_destroy(&sb_info->s_freeinodes_counter);
+	percpu_counter_destroy(&sb_info->s_dirtyblocks_counter);
 	brelse(sb_info->s_sbh);
-	brelse(sb_info->s_block_bitmap_bh);
-	brelse(sb_info->s_inode_bitmap_bh);
-	brelse(sb_info->s_inode_table_bh);
 	kfree(sb_info);
 	sb->s_fs_info = NULL;
 }
@@ -353,42 +882,425 @@ void lab5fs_put_super(struct super_block *sb){
 /*Write Inode to on-disk*/
 void lab5fs_write_inode(struct inode *ino,int sync)
 {
-        printk("writing inode %ld to disk\n", ino->i_ino);
-        lab5fs_inode_write_ino (ino);
+        struct super_block *sb = ino->i_sb;
+        struct lab5fs_handle handle;
+        struct timeval op_start;
+
+        lab5fs_stats_start(&op_start);
+        lab5fs_dbg("writing inode %ld to disk\n", ino->i_ino);
+        lab5fs_journal_start(sb, &handle, 1);
+        lab5fs_inode_write_ino (ino, sync && !LAB5FS_SB_INFO(sb)->s_journal);
+        lab5fs_journal_stop(&handle);
+        if (sync)
+                lab5fs_journal_commit(sb);
+        lab5fs_stats_end(sb, LAB5FS_OP_IWRITE, &op_start);
+}
+
+/*
+ * With a journal, an inode is copied into its inode table block as soon
+ * as it is dirtied, so the change commits with the operation that made
+ * it instead of whenever writeback gets to the inode.
+ */
+void lab5fs_dirty_inode(struct inode *ino)
+{
+        struct lab5fs_handle handle;
+
+        if (!LAB5FS_SB_INFO(ino->i_sb)->s_journal)
+                return;
+        lab5fs_journal_start(ino->i_sb, &handle, 1);
+        lab5fs_inode_write_ino(ino, 0);
+        lab5fs_journal_stop(&handle);
+}
+
+/*
+ * Deleting a large file takes many bitmap and extent block updates, so
+ * delete_inode only puts such an inode on the orphan list and leaves the
+ * rest to a per-mount worker. The list lives on disk - s_last_orphan in
+ * the super block, then i_next_orphan of each inode - so deletions cut
+ * short by a crash are finished at the next mount. An orphan keeps its
+ * inode number and blocks until the worker gets to it, and only the
+ * worker deletes orphans, one at a time from the head of the list.
+ */
+
+/* Read the on-disk copy of an inode, to follow the orphan list. */
+static struct buffer_head *lab5fs_orphan_bread(struct super_block *sb,
+                                               unsigned long ino_num,
+                                               struct lab5fs_inode **raw)
+{
+        unsigned long block_num, offset;
+        struct buffer_head *bh;
+
+        block_num = lab5fs_inode_block(sb, ino_num, &offset);
+        if (block_num == 0 || !(bh = sb_bread(sb, block_num)))
+                return NULL;
+        *raw = (struct lab5fs_inode *)(bh->b_data + offset);
+        return bh;
+}
+
+static void lab5fs_set_last_orphan(struct super_block *sb, unsigned long ino_num)
+{
+        struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+
+        lock_buffer(sb_info->s_sbh);
+        sb_info->s_lab5fs_sb->s_last_orphan = cpu_to_le32(ino_num);
+        unlock_buffer(sb_info->s_sbh);
+        lab5fs_journal_dirty(sb, NULL, sb_info->s_sbh);
+}
+
+/*
+ * Put an inode at the head of the orphan list, as part of the caller's
+ * handle. Besides unlinked inodes awaiting deletion the list holds files
+ * in the middle of a truncate too long for one transaction.
+ * returns 0 on success, a negative error code on failure.
+ */
+int lab5fs_orphan_insert(struct inode *ino)
+{
+        struct super_block *sb = ino->i_sb;
+        struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+        struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+        int err;
+
+        down(&sb_info->s_orphan_sem);
+        inode_info->i_next_orphan = le32_to_cpu(sb_info->s_lab5fs_sb->s_last_orphan);
+        inode_info->i_flags |= LAB5FS_ORPHAN_FL;
+        err = lab5fs_inode_write_ino(ino, !sb_info->s_journal);
+        if (!err) {
+                lab5fs_set_last_orphan(sb, ino->i_ino);
+                if (!sb_info->s_journal)
+                        err = sync_dirty_buffer(sb_info->s_sbh);
+        }
+        if (err)
+                inode_info->i_flags &= ~LAB5FS_ORPHAN_FL;
+        up(&sb_info->s_orphan_sem);
+        return err;
+}
+
+/*
+ * Put an unlinked inode at the head of the orphan list and wake the
+ * worker. The inode and then the super block reach the disk before this
+ * returns, so the record survives a crash; with a journal both go in one
+ * transaction, committed before returning.
+ * returns 0 on success, a negative error code on failure.
+ */
+static int lab5fs_orphan_add(struct inode *ino)
+{
+        struct super_block *sb = ino->i_sb;
+        struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+        struct lab5fs_handle handle;
+        int err;
+
+        lab5fs_journal_start(sb, &handle, LAB5FS_INODE_CREDITS);
+        err = lab5fs_orphan_insert(ino);
+        lab5fs_journal_stop(&handle);
+
+        if (!err)
+                err = lab5fs_journal_commit(sb);
+        if (!err)
+                queue_work(sb_info->s_orphan_wq, &sb_info->s_orphan_work);
+        return err;
+}
+
+/* Take an orphan whose blocks have been freed off the list. */
+void lab5fs_orphan_del(struct inode *ino)
+{
+        struct super_block *sb = ino->i_sb;
+        struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+        unsigned long next = LAB5FS_INODE_INFO(ino)->i_next_orphan;
+        unsigned long cur, n = 0;
+        struct lab5fs_inode *raw;
+        struct buffer_head *bh;
+
+        down(&sb_info->s_orphan_sem);
+        cur = le32_to_cpu(sb_info->s_lab5fs_sb->s_last_orphan);
+        if (cur == ino->i_ino) {
+                lab5fs_set_last_orphan(sb, next);
+                goto ret;
+        }
+
+        /* newer orphans were pushed in front of it meanwhile. */
+        while (cur != 0 && n++ < le32_to_cpu(sb_info->s_lab5fs_sb->s_inode_count)) {
+                if (!(bh = lab5fs_orphan_bread(sb, cur, &raw)))
+                        break;
+                cur = le32_to_cpu(raw->i_next_orphan);
+                if (cur == ino->i_ino) {
+                        lock_buffer(bh);
+                        raw->i_next_orphan = cpu_to_le32(next);
+                        unlock_buffer(bh);
+                        lab5fs_journal_dirty(sb, NULL, bh);
+                        brelse(bh);
+                        goto ret;
+                }
+                brelse(bh);
+        }
+        printk("inode %lu is missing from the orphan list\n", ino->i_ino);
+  ret:
+        up(&sb_info->s_orphan_sem);
+}
+
+/*
+ * Finish the deletions on the orphan list. Each orphan is read back in;
+ * its link count is 0, so dropping it runs delete_inode again, which this
+ * time frees everything and takes it off the list. An orphan that still
+ * has links is a truncate cut short by a crash, and is truncated again.
+ */
+static void lab5fs_orphan_work(void *data)
+{
+        struct super_block *sb = data;
+        struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+        struct inode *ino;
+        unsigned long ino_num, last = 0;
+        int moved;
+
+        for (;;) {
+                down(&sb_info->s_orphan_sem);
+                ino_num = le32_to_cpu(sb_info->s_lab5fs_sb->s_last_orphan);
+                up(&sb_info->s_orphan_sem);
+                if (ino_num == 0)
+                        break;
+                if (ino_num == last) {
+                        printk("orphan inode %lu could not be deleted\n", ino_num);
+                        break;
+                }
+
+                ino = lab5fs_iget(sb, ino_num);
+                if (IS_ERR(ino))
+                        break;
+                if (!(LAB5FS_INODE_INFO(ino)->i_flags & LAB5FS_ORPHAN_FL)) {
+                        /* its own delete_inode may have just finished it. */
+                        down(&sb_info->s_orphan_sem);
+                        moved = le32_to_cpu(sb_info->s_lab5fs_sb->s_last_orphan) != ino_num;
+                        up(&sb_info->s_orphan_sem);
+                        if (!moved)
+                                printk("inode %lu on the orphan list is not an orphan\n",
+                                       ino_num);
+                        /* a freed slot: dropping it must not free it again. */
+                        if (ino->i_nlink == 0)
+                                make_bad_inode(ino);
+                        iput(ino);
+                        if (!moved)
+                                break;
+                        continue;
+                }
+                if (ino->i_nlink != 0) {
+                        mutex_lock(&ino->i_mutex);
+                        lab5fs_truncate(ino);
+                        mutex_unlock(&ino->i_mutex);
+                }
+                iput(ino);
+                last = ino_num;
+        }
+}
+
+/* Wait for the orphan worker; unmount calls this before evicting inodes. */
+void lab5fs_orphan_flush(struct super_block *sb)
+{
+        struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+
+        if (sb_info)
+                flush_workqueue(sb_info->s_orphan_wq);
 }
 
 /*Delete inode from VFS and disk*/
 void lab5fs_delete_inode (struct inode *ino)
 {
-        printk("deleting inode %ld\n", ino->i_ino);
+        struct lab5fs_inode_info *inode_info = LAB5FS_INODE_INFO(ino);
+        struct lab5fs_handle handle;
+
+        lab5fs_dbg("deleting inode %ld\n", ino->i_ino);
+
+        /* an inode read back from a freed slot (see lab5fs_orphan_work). */
+        if (is_bad_inode(ino)) {
+                clear_inode(ino);
+                return;
+        }
 
         /* delete the inode from the file-system - free its blocks,
          * then mark it as free. */
 
+        /* drop cached pages; a large file's blocks are left to the worker. */
+        truncate_inode_pages(&ino->i_data, 0);
+        if (!(inode_info->i_flags & LAB5FS_ORPHAN_FL) &&
+            ino->i_blocks >= LAB5FS_ASYNC_DELETE_BLOCKS &&
+            lab5fs_orphan_add(ino) == 0) {
+                clear_inode(ino);
+                return;
+        }
+
         /* free data blocks of this inode. */
+        lab5fs_journal_start(ino->i_sb, &handle, LAB5FS_TRUNCATE_CREDITS);
         ino->i_size = 0;
         if (ino->i_blocks) { /*file contains data inside*/
-                printk("clearing data blocks, #blocks = %ld\n", ino->i_blocks);
+                lab5fs_dbg("clearing data blocks, #blocks = %ld\n", ino->i_blocks);
                 lab5fs_inode_clear_blocks(ino);
         }
 
+        /* an orphan must not point at the freed blocks once off the list,
+         * nor look like one to a worker reading its freed slot. */
+        if (inode_info->i_flags & LAB5FS_ORPHAN_FL) {
+                inode_info->i_flags &= ~LAB5FS_ORPHAN_FL;
+                lab5fs_inode_write_ino(ino, 0);
+                lab5fs_orphan_del(ino);
+        }
+
         /* free the block index and the inode's block numbers. */
         lab5fs_inode_free_inode(ino);
+        lab5fs_journal_stop(&handle);
 
-  
         clear_inode(ino);
 }
 
-/*Release an inode and clear memory used by inode*/
-void lab5fs_clear_inode (struct inode * ino){
-	printk("Releasing inode #%ld from VFS\n",ino->i_ino);
-	lab5fs_inode_clear(ino); /*function defined in lab5fs_inode.c*/
+/*
+ * Report usage from the free counters the allocators keep in memory, so
+ * statfs costs the same on any volume size and never touches the disk.
+ * The counts may lag by the per-cpu batch while allocations are running.
+ */
+int lab5fs_statfs (struct dentry *dentry, struct kstatfs *buf)
+{
+        struct super_block *sb = dentry->d_sb;
+        struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+        struct lab5fs_super_block *lab5fs_sb = sb_info->s_lab5fs_sb;
+        long dirty;
+
+        buf->f_type = LAB5FS_SUPER_MAGIC;
+        buf->f_bsize = LAB5FS_BLOCK_SIZE;
+        buf->f_blocks = le32_to_cpu(lab5fs_sb->s_blocks_count);
+        /*blocks reserved for delayed allocation are as good as used*/
+        buf->f_bfree = percpu_counter_read_positive(&sb_info->s_freeblocks_counter);
+        dirty = percpu_counter_read_positive(&sb_info->s_dirtyblocks_counter);
+        buf->f_bfree = buf->f_bfree > dirty ? buf->f_bfree - dirty : 0;
+        buf->f_bavail = buf->f_bfree;
+        buf->f_files = le32_to_cpu(lab5fs_sb->s_inode_count);
+        buf->f_ffree = percpu_counter_read_positive(&sb_info->s_freeinodes_counter);
+        buf->f_namelen = LAB5FS_MAX_FNAME;
+        return 0;
 }
 
+/*
+ * The allocators only touch the per-cpu free counters; fold them into the
+ * on-disk super block buffer.
+ */
+static void lab5fs_fold_counters(struct super_block *sb)
+{
+        struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+        struct lab5fs_super_block *lab5fs_sb = sb_info->s_lab5fs_sb;
+        struct lab5fs_handle handle;
+        long free_blocks, free_inodes;
+
+        free_blocks = percpu_counter_sum(&sb_info->s_freeblocks_counter);
+        free_inodes = percpu_counter_sum(&sb_info->s_freeinodes_counter);
+
+        lab5fs_journal_start(sb, &handle, 1);
+        lock_buffer(sb_info->s_sbh);
+        lab5fs_sb->s_free_blocks_count = free_blocks < 0 ? 0 : free_blocks;
+        lab5fs_sb->s_free_inodes_count = free_inodes < 0 ? 0 : free_inodes;
+        unlock_buffer(sb_info->s_sbh);
+        lab5fs_journal_dirty(sb, NULL, sb_info->s_sbh);
+        lab5fs_journal_stop(&handle);
+}
 
-/* nothing to do - the super-block is stored in buffers, which already get written to disk*/
+/*
+ * Write the free counters to the super block buffer, which the buffer
+ * cache writes out. With a journal this is also where the periodic commit
+ * happens: the VFS calls it every few seconds while the super block is
+ * dirty, which any journaled change makes it.
+ */
 void lab5fs_write_super (struct super_block *sb)
 {
-        printk("writing superblock to disk\n");
+        lab5fs_dbg("writing superblock to disk\n");
+        lab5fs_fold_counters(sb);
         sb->s_dirt = 0;
+        lab5fs_journal_commit(sb);
+}
+
+/* buffers handed to ll_rw_block at a time by lab5fs_sync_metadata */
+#define LAB5FS_SYNC_BATCH 32
+
+static void lab5fs_sync_add(struct buffer_head **batch, int *nr,
+                            struct buffer_head *bh)
+{
+        if (!bh || !buffer_dirty(bh))
+                return;
+        batch[(*nr)++] = bh;
+        if (*nr == LAB5FS_SYNC_BATCH) {
+                ll_rw_block(WRITE, *nr, batch);
+                *nr = 0;
+        }
+}
+
+static int lab5fs_sync_wait(struct buffer_head *bh)
+{
+        if (!bh)
+                return 0;
+        wait_on_buffer(bh);
+        /* ll_rw_block skips buffers already under I/O; catch any that
+         * were dirtied again meanwhile. */
+        if (buffer_dirty(bh))
+                return sync_dirty_buffer(bh);
+        return buffer_uptodate(bh) ? 0 : -EIO;
+}
+
+/*
+ * Write out the volume-wide metadata pinned in sb_info - every bitmap read
+ * so far, the group descriptors and then the super block - along with an
+ * optional extra buffer from the caller, as one batch. With wait set, wait
+ * for all of it and issue a single cache flush, so a durable commit costs
+ * one device flush however many blocks it touched. Clean buffers are
+ * skipped.
+ * returns 0 on success, a negative error code on failure.
+ */
+int lab5fs_sync_metadata(struct super_block *sb, struct buffer_head *extra,
+                         int wait)
+{
+        struct lab5fs_sb_info *sb_info = LAB5FS_SB_INFO(sb);
+        struct buffer_head *batch[LAB5FS_SYNC_BATCH];
+        struct lab5fs_group_info *gi;
+        unsigned long i;
+        int nr = 0, err = 0;
+
+        /* fold the free counters into the super block buffer first. With
+         * a journal, committing covers all of it, extra included. */
+        lab5fs_fold_counters(sb);
+        if (sb_info->s_journal)
+                return lab5fs_journal_commit(sb);
+
+        lab5fs_sync_add(batch, &nr, extra);
+        for (i = 0; i < sb_info->s_groups_count; i++) {
+                gi = &sb_info->s_group_info[i];
+                lab5fs_sync_add(batch, &nr, gi->g_block_bitmap);
+                lab5fs_sync_add(batch, &nr, gi->g_inode_bitmap);
+        }
+        for (i = 0; i < sb_info->s_gdt_blocks; i++)
+                lab5fs_sync_add(batch, &nr, sb_info->s_group_desc[i]);
+        lab5fs_sync_add(batch, &nr, sb_info->s_sbh);
+        if (nr)
+                ll_rw_block(WRITE, nr, batch);
+
+        if (!wait)
+                return 0;
+
+        err |= lab5fs_sync_wait(extra);
+        for (i = 0; i < sb_info->s_groups_count; i++) {
+                gi = &sb_info->s_group_info[i];
+                err |= lab5fs_sync_wait(gi->g_block_bitmap);
+                err |= lab5fs_sync_wait(gi->g_inode_bitmap);
+        }
+        for (i = 0; i < sb_info->s_gdt_blocks; i++)
+                err |= lab5fs_sync_wait(sb_info->s_group_desc[i]);
+        err |= lab5fs_sync_wait(sb_info->s_sbh);
+        if (err) {
+                printk("lab5fs: error writing metadata\n");
+                return -EIO;
+        }
+
+        /* devices without a write cache have nothing to flush. */
+        err = blkdev_issue_flush(sb->s_bdev, NULL);
+        if (err == -EOPNOTSUPP)
+                err = 0;
+        return err;
+}
+
+int lab5fs_sync_fs (struct super_block *sb, int wait)
+{
+        lab5fs_dbg("syncing file system, wait=%d\n", wait);
+        return lab5fs_sync_metadata(sb, NULL, wait);
 }
@@ -2,17 +2,81 @@
 #define LAB5FS_SUPER_H
 
 #include <linux/fs.h>
+#include <linux/percpu_counter.h>
+#include <linux/workqueue.h>
+#include <asm/semaphore.h>
+
+/*MACRO for accessing the superblock info pointer*/
+#define LAB5FS_SB_INFO(sb) ((struct lab5fs_sb_info*)((sb)->s_fs_info))
+
+/*mount options*/
+#define LAB5FS_MOUNT_SPARSE 0x0001 //write all-zero blocks as holes
+#define LAB5FS_TEST_OPT(sb, opt) (LAB5FS_SB_INFO(sb)->s_mount_opt & LAB5FS_MOUNT_##opt)
+
+struct lab5fs_group_info;
+struct lab5fs_stats;
+struct lab5fs_journal;
+
+/* Store custom metadata about filesystem*/
+struct lab5fs_sb_info {
+	/*lab5fs super block*/
+	struct buffer_head *s_sbh;
+        struct lab5fs_super_block *s_lab5fs_sb;
+
+	/*group descriptor table, pinned for the life of the mount*/
+	unsigned long s_groups_count;
+	unsigned long s_gdt_blocks;
+	struct buffer_head **s_group_desc;
+	struct lab5fs_group_info *s_group_info;
+
+	/*free counts, folded into the on-disk super block by write_super*/
+	struct percpu_counter s_freeblocks_counter;
+	struct percpu_counter s_freeinodes_counter;
+
+	/*blocks promised to buffered writes (delayed allocation) but not yet
+	 *allocated; they still count as free in s_freeblocks_counter*/
+	struct percpu_counter s_dirtyblocks_counter;
+
+	/*next-fit cursor: where the block allocator resumes searching.
+	 *only a hint, so it is updated without a lock*/
+	unsigned long s_next_block;
+
+	/*orphan list (deletions handed to s_orphan_wq), under s_orphan_sem*/
+	struct semaphore s_orphan_sem;
+	struct workqueue_struct *s_orphan_wq;
+	struct work_struct s_orphan_work;
+
+	/*LAB5FS_MOUNT_* flags*/
+	unsigned long s_mount_opt;
+
+	/*metadata journal, NULL if the volume has none*/
+	struct lab5fs_journal *s_journal;
+
+	/*per-cpu operation counters and their debugfs directory*/
+	struct lab5fs_stats *s_stats;
+	struct dentry *s_debugfs_dir;
+	struct dentry *s_debugfs_stats;
+};
 
 
 /*
  * Utilities
  */
-int lab5fs_alloc_block_num(struct super_block *); //grabs the first free block number from the block bitmap
+int lab5fs_new_blocks(struct super_block *, unsigned long, int *); //grabs a run of free blocks near a goal block
+int lab5fs_alloc_block_num(struct super_block *); //grabs the next free block number from the block bitmap
 int lab5fs_release_block_num(struct super_block *, int); //releases block number
-int lab5fs_alloc_inode_num(struct super_block *, int); //grabs the first free inode number
+int lab5fs_release_block_range(struct super_block *, int, int); //releases a run of block numbers
+int lab5fs_alloc_inode_num(struct super_block *); //grabs the first free inode number
 int lab5fs_release_inode_num(struct super_block *, int ); //releases the given inode number
-unsigned long lab5fs_find_block_num(struct inode *ino); //finds the block number of a given inode
+int lab5fs_reserve_blocks(struct super_block *, long); //sets free blocks aside for delayed allocation
+void lab5fs_release_reservation(struct super_block *, long); //gives back reserved blocks
+unsigned long lab5fs_inode_block(struct super_block *, unsigned long, unsigned long *); //finds the block and offset of a given inode
 
 int lab5fs_fill_super(struct super_block*,void *, int);
+struct inode *lab5fs_iget(struct super_block *, unsigned long); //gets an inode, reading it in if needed
+void lab5fs_orphan_flush(struct super_block *); //waits for deletions in progress
+int lab5fs_orphan_insert(struct inode *); //puts an inode on the orphan list within the current handle
+void lab5fs_orphan_del(struct inode *); //takes it off again
+int lab5fs_sync_metadata(struct super_block *, struct buffer_head *, int); //writes out allocation state as one batch
 
 #endif /*LAB5_SUPER_H*/
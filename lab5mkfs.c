@@ -1,12 +1,20 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include "lab5fs.h"
 
-#define HIGHEST_USED_BLOCK_NUM LAB5FS_ROOT_DATA_FIRST_NUM
+/* smallest tail worth keeping as a group of its own: its bitmaps and
+ * inode table plus some data */
+#define MIN_GROUP_BLOCKS (2 + LAB5FS_ITABLE_BLOCKS + 16)
+
+/* block group geometry, computed from the image size in main() */
+static int groups_count;
+static int gdt_blocks;
+static int journal_blocks; /* 0 if the image is too small for a journal */
 
 /* write the given data to the given logical block number.
  * returns 1 on success, 0 on failure.
@@ -16,20 +24,21 @@ int write_block(const char* dev_path,
 			   int block_num, char* data, int data_len)
 {
 	int rc;
-	off_t seek_pos = block_num * LAB5FS_BLOCK_SIZE;
+	off_t seek_pos = (off_t)block_num * LAB5FS_BLOCK_SIZE; /* images may exceed 2 GiB */
+	off_t pos;
 
 	/* we need to write into block #1. */
-	rc = lseek(fd, seek_pos, SEEK_SET);
-	if (rc == -1) {
+	pos = lseek(fd, seek_pos, SEEK_SET);
+	if (pos == -1) {
 			printf( "%failed seeking into position %lu "
 					"of file '%s'\n",
 					seek_pos,dev_path);
 			return 0;
 	}
-	if (rc != seek_pos) {
+	if (pos != seek_pos) {
 			printf("failed seeking into position %lu of file '%s' - "
-					"lseek returned %d.\n",
-					seek_pos,dev_path, rc);
+					"lseek returned %ld.\n",
+					seek_pos,dev_path, (long)pos);
 			return 0;
 	}
 
@@ -49,6 +58,8 @@ int write_block(const char* dev_path,
     return 1;
 }
 
+static int group_inode_table(int group);
+
 /*Write the Lab5 Super Block*/
 int write_super_block(const char* dev_path,int fd, int num_blocks, int num_free_blocks)
 {
@@ -57,11 +68,20 @@ int write_super_block(const char* dev_path,int fd, int num_blocks, int num_free_
 
 	memset(&lab5_sb, 0, sizeof(lab5_sb));
 	lab5_sb.s_magic = LAB5FS_SUPER_MAGIC;
-	lab5_sb.s_inode_count = LAB5FS_MAX_INODE_COUNT;
+	lab5_sb.s_inode_count = groups_count * LAB5FS_INODES_PER_GROUP;
 	lab5_sb.s_blocks_count = num_blocks;
-	lab5_sb.s_free_inodes_count = LAB5FS_MAX_INODE_COUNT - 1;
+	/* inode 0 is reserved and inode 1 is the root */
+	lab5_sb.s_free_inodes_count = lab5_sb.s_inode_count - 2;
 	lab5_sb.s_free_blocks_count = num_free_blocks;
 	lab5_sb.s_block_size=LAB5FS_BLOCK_SIZE; 
+	lab5_sb.s_blocks_per_group = LAB5FS_BLOCKS_PER_GROUP;
+	lab5_sb.s_inodes_per_group = LAB5FS_INODES_PER_GROUP;
+	lab5_sb.s_groups_count = groups_count;
+	lab5_sb.s_gdt_blocks = gdt_blocks;
+	lab5_sb.s_inode_size = LAB5FS_INODE_SIZE;
+	lab5_sb.s_journal_blocks = journal_blocks;
+	if (journal_blocks)
+		lab5_sb.s_journal_block = group_inode_table(0) + LAB5FS_ITABLE_BLOCKS;
 	
 
 	/*write to super block (block 0)*/
@@ -72,64 +92,125 @@ int write_super_block(const char* dev_path,int fd, int num_blocks, int num_free_
 }
 
 
-/* write the block bitmap. */
-int write_block_bitmap(const char* dev_path, int fd)
+/* first block number of the given group */
+static int group_first_block(int group)
 {
-	struct lab5fs_bitmap block_bitmap;
-	int rc;
+	return group * LAB5FS_BLOCKS_PER_GROUP;
+}
 
-	/* everything should be zero, except for the first 7 bits*/
-	memset(&block_bitmap, 0, sizeof(block_bitmap));
-	block_bitmap.map[0] = 0x7F; /*set the first 7 bits to 1*/
+/* blocks of the image covered by the given group (the last group may be short) */
+static int group_blocks(int group, int num_blocks)
+{
+	int left = num_blocks - group_first_block(group);
 
-	/* write to inode block bitmap (block 1). */
-	rc = write_block(dev_path, fd, "block bitmap",
-					 LAB5FS_BLOCK_BITMAP_NUM,
-					 (char*)&block_bitmap, sizeof(block_bitmap));
-	return rc;
+	return left < LAB5FS_BLOCKS_PER_GROUP ? left : LAB5FS_BLOCKS_PER_GROUP;
 }
 
-/* write the block bitmap. */
-int write_inode_bitmap(const char* dev_path, int fd)
+/* first block of the given group's inode table */
+static int group_inode_table(int group)
 {
-	struct lab5fs_bitmap inode_bitmap;
-	int rc;
+	/* group 0 holds blocks 0-2 followed by the descriptor table; every
+	 * other group starts with its block bitmap and inode bitmap. */
+	if (group == 0)
+		return LAB5FS_GDT_FIRST_NUM + gdt_blocks;
+	return group_first_block(group) + 2;
+}
 
-	/* everything should be zero, except for the first inode (maps null)
-	 * and second inode (maps to root)
-	*/
-	memset(&inode_bitmap, 0, sizeof(inode_bitmap));
-	inode_bitmap.map[0] = 0x3; /*set the first and second inode bit to 1*/
+/* blocks at the start of the given group taken by metadata. group 0's
+ * inode table is followed by the journal. */
+static int group_used_blocks(int group)
+{
+	int used = group_inode_table(group) + LAB5FS_ITABLE_BLOCKS - group_first_block(group);
 
-	/* write to inode bitmap block (block 2). */
-	rc = write_block(dev_path, fd, "inode bitmap",
-					 LAB5FS_INODE_BITMAP_NUM,
-					 (char*)&inode_bitmap, sizeof(inode_bitmap));
-	return rc;
+	if (group == 0)
+		used += journal_blocks;
+	return used;
 }
 
-/* write the inode table block. */
-int write_inode_table(const char* dev_path,int fd)
+/* free blocks in the whole image */
+static int count_free_blocks(int num_blocks)
 {
-	struct lab5fs_inode_table table;
-	int rc;
+	int group, free_blocks = 0;
 
-	/*clear out table*/
-	memset(&table, 0, sizeof(table));
+	for (group = 0; group < groups_count; group++)
+		free_blocks += group_blocks(group, num_blocks) - group_used_blocks(group);
+	return free_blocks;
+}
 
-	/*point inode #0 to the root inode block*/
-	table.inodes[LAB5FS_ROOT_INODE]=LAB5FS_ROOT_INODE_NUM;
-	/*write to inode table block (block 3)*/
-	rc = write_block(dev_path, fd, "inode table",
-			LAB5FS_INODE_TABLE_NUM,
-			(char*)&table, sizeof(table));
+/* write the group descriptor table. */
+int write_group_descs(const char* dev_path, int fd, int num_blocks)
+{
+	struct lab5fs_group_desc descs[LAB5FS_DESC_PER_BLOCK];
+	int group, i, rc = 1;
+
+	for (i = 0; i < gdt_blocks && rc; i++) {
+		memset(descs, 0, sizeof(descs));
+		for (group = i * LAB5FS_DESC_PER_BLOCK;
+		     group < groups_count && group < (i + 1) * (int)LAB5FS_DESC_PER_BLOCK;
+		     group++) {
+			struct lab5fs_group_desc *desc = &descs[group % LAB5FS_DESC_PER_BLOCK];
+
+			if (group == 0) {
+				desc->bg_block_bitmap = LAB5FS_BLOCK_BITMAP_NUM;
+				desc->bg_inode_bitmap = LAB5FS_INODE_BITMAP_NUM;
+				desc->bg_free_inodes_count = LAB5FS_INODES_PER_GROUP - 2;
+			} else {
+				desc->bg_block_bitmap = group_first_block(group);
+				desc->bg_inode_bitmap = group_first_block(group) + 1;
+				desc->bg_free_inodes_count = LAB5FS_INODES_PER_GROUP;
+			}
+			desc->bg_inode_table = group_inode_table(group);
+			desc->bg_free_blocks_count = group_blocks(group, num_blocks) -
+						     group_used_blocks(group);
+		}
+
+		rc = write_block(dev_path, fd, "group descriptors",
+				 LAB5FS_GDT_FIRST_NUM + i,
+				 (char*)descs, sizeof(descs));
+	}
+	return rc;
+}
+
+/* write the block bitmap and inode bitmap of every group. */
+int write_bitmaps(const char* dev_path, int fd, int num_blocks)
+{
+	struct lab5fs_bitmap block_bitmap;
+	struct lab5fs_bitmap inode_bitmap;
+	int group, i, rc = 1;
+
+	for (group = 0; group < groups_count && rc; group++) {
+		/* mark the group's metadata blocks, and the blocks past the
+		 * end of the image in a short last group, as used. */
+		memset(&block_bitmap, 0, sizeof(block_bitmap));
+		for (i = 0; i < group_used_blocks(group); i++)
+			block_bitmap.map[i / 8] |= 1 << (i % 8);
+		for (i = group_blocks(group, num_blocks); i < LAB5FS_BLOCKS_PER_GROUP; i++)
+			block_bitmap.map[i / 8] |= 1 << (i % 8);
+
+		/* inode 0 maps null and inode 1 is the root */
+		memset(&inode_bitmap, 0, sizeof(inode_bitmap));
+		if (group == 0)
+			inode_bitmap.map[0] = 0x3;
+
+		rc = write_block(dev_path, fd, "block bitmap",
+				 group ? group_first_block(group) : LAB5FS_BLOCK_BITMAP_NUM,
+				 (char*)&block_bitmap, sizeof(block_bitmap));
+		if (rc)
+			rc = write_block(dev_path, fd, "inode bitmap",
+					 group ? group_first_block(group) + 1 : LAB5FS_INODE_BITMAP_NUM,
+					 (char*)&inode_bitmap, sizeof(inode_bitmap));
+	}
 	return rc;
 }
 
-/* write the root inode. */
+/* write the first inode table block, which holds the root inode. the rest
+ * of the inode tables are left as they are: the module only reads slots of
+ * allocated inodes, and fills a slot in full when it allocates it. */
 int write_root_inode(const char* dev_path, int fd)
 {
+	char block[LAB5FS_BLOCK_SIZE];
 	struct lab5fs_inode root_inode;
+	struct lab5fs_dir_head *head = (struct lab5fs_dir_head *)root_inode.i_inline;
 	int rc;
 
 	memset((char*)&root_inode, 0, sizeof(root_inode));
@@ -141,54 +222,60 @@ int write_root_inode(const char* dev_path, int fd)
 	root_inode.i_atime = 0;
 	root_inode.i_mtime = 0;
 	root_inode.i_ctime = 0;
-	root_inode.i_num_blocks = 1;
+	root_inode.i_num_blocks = 0;
 	root_inode.i_link_count = 1;
-	root_inode.i_block_num = LAB5FS_ROOT_INODE_NUM;
-	root_inode.i_data_index_block_num=LAB5FS_ROOT_DATA_INDEX_NUM;
-	
 
-	/* write into root inode block (block #4)*/
+	/* an empty extent tree: the root directory starts with no blocks */
+	root_inode.i_eh.eh_magic = LAB5FS_EXTENT_MAGIC;
+	root_inode.i_eh.eh_count = 0;
+	root_inode.i_eh.eh_max = LAB5FS_INODE_EXTENTS;
+	root_inode.i_eh.eh_depth = 0;
+
+	/* its entries live in an empty leaf inside the inode */
+	root_inode.i_flags = LAB5FS_INLINE_DATA_FL;
+	head->dh_magic = LAB5FS_DIR_LEAF_MAGIC;
+	head->dh_count = 0;
+	head->dh_limit = LAB5FS_INLINE_DIR_SPACE;
+	head->dh_levels = 0;
+	/* holding one free record that spans it */
+	((struct lab5fs_dir *)(head + 1))->dir_rec_len = LAB5FS_INLINE_DIR_SPACE;
+
+	/* write into slot LAB5FS_ROOT_INODE of group 0's inode table */
+	memset(block, 0, sizeof(block));
+	memcpy(block + (LAB5FS_ROOT_INODE % LAB5FS_INODES_PER_BLOCK) * LAB5FS_INODE_SIZE,
+	       &root_inode, sizeof(root_inode));
 	rc = write_block(dev_path, fd, "root inode",
-			LAB5FS_ROOT_INODE_NUM,
-			(char*)&root_inode,
-			sizeof(root_inode));
+			group_inode_table(0) + LAB5FS_ROOT_INODE / LAB5FS_INODES_PER_BLOCK,
+			block, sizeof(block));
 	return rc;
 }
 
-/* write the block index of the root inode. */
-int write_root_data_index(const char* dev_path, int fd)
+/* write an empty journal: a journal super block pointing at the start of
+ * the log, and zeroed log blocks so no stale data looks like a transaction */
+int write_journal(const char* dev_path, int fd)
 {
-        struct lab5fs_inode_data_index root_block_index;
-        int rc;
-
-        memset((char*)&root_block_index, 0, sizeof(root_block_index));
-        root_block_index.blocks[0] = LAB5FS_ROOT_DATA_FIRST_NUM;
-
-        /* write into the root inode's data index block (block 5)*/
-        rc = write_block(dev_path, fd,
-                         "root inode block index",
-                          LAB5FS_ROOT_DATA_INDEX_NUM,
-                         (char*)&root_block_index, sizeof(root_block_index));
-        return rc;
-}
+	char block[LAB5FS_BLOCK_SIZE];
+	struct lab5fs_journal_super *js = (struct lab5fs_journal_super *)block;
+	int first = group_inode_table(0) + LAB5FS_ITABLE_BLOCKS;
+	int i, rc = 1;
+
+	if (!journal_blocks)
+		return 1;
+
+	memset(block, 0, sizeof(block));
+	for (i = 1; i < journal_blocks && rc; i++)
+		rc = write_block(dev_path, fd, "journal", first + i,
+				 block, sizeof(block));
+	if (!rc)
+		return 0;
 
-/* write the first (and only) data block of the root directory (i.e. the root
- * inode).
- */
-int write_root_data(const char* dev_path, int fd)
-{
-        struct lab5fs_dir root_dir;
-        int rc;
-
-        memset((char*)&root_dir, 0, sizeof(root_dir));
-        root_dir.dir_inode = 0;
-
-        /* write data to first root data block (block 6) */
-        rc = write_block(dev_path, fd,
-                                "root inode first data block",
-                                LAB5FS_ROOT_DATA_FIRST_NUM,
-                                (char*)&root_dir, sizeof(root_dir));
-        return rc;
+	js->js_header.jh_magic = LAB5FS_JOURNAL_MAGIC;
+	js->js_header.jh_type = LAB5FS_JOURNAL_SUPER;
+	js->js_blocks = journal_blocks;
+	js->js_start = 1;
+	js->js_sequence = 1;
+	return write_block(dev_path, fd, "journal super block", first,
+			   block, sizeof(block));
 }
 
 /*Check to make sure file passed is accessable, has write permissions, and is a block device*/
@@ -240,17 +327,12 @@ int mklab5fs(const char* dev_path, int num_blocks, int num_free_blocks)
 		return 0;
 	}
 	
-	if (!write_block_bitmap(dev_path, fd)) {
-		close(fd);
-		return 0;
-	}
-
-	if (!write_inode_bitmap(dev_path, fd)) {
+	if (!write_group_descs(dev_path, fd, num_blocks)) {
 		close(fd);
 		return 0;
 	}
 
-	if (!write_inode_table(dev_path, fd)) {
+	if (!write_bitmaps(dev_path, fd, num_blocks)) {
 		close(fd);
 		return 0;
 	}
@@ -259,12 +341,8 @@ int mklab5fs(const char* dev_path, int num_blocks, int num_free_blocks)
 		close(fd);
 		return 0;
 	}
-	
-	if (!write_root_data_index(dev_path, fd)) {
-		close(fd);
-		return 0;
-	}
-	if (!write_root_data(dev_path, fd)) {
+
+	if (!write_journal(dev_path, fd)) {
 		close(fd);
 		return 0;
 	}
@@ -295,7 +373,27 @@ int main(int argc, char *argv[]){
 	/* make basic checks - the path exists and points to a device file*/
 	if (!check_dev(dev_path, &num_blocks))
 			exit(1);
-	free_blocks = num_blocks - (HIGHEST_USED_BLOCK_NUM + 1);
+
+	/* split the image into block groups. a tail too small to hold a
+	 * group's metadata is left unused. */
+	if (num_blocks % LAB5FS_BLOCKS_PER_GROUP != 0 &&
+	    num_blocks > LAB5FS_BLOCKS_PER_GROUP &&
+	    num_blocks % LAB5FS_BLOCKS_PER_GROUP < MIN_GROUP_BLOCKS)
+			num_blocks -= num_blocks % LAB5FS_BLOCKS_PER_GROUP;
+	groups_count = (num_blocks + LAB5FS_BLOCKS_PER_GROUP - 1) / LAB5FS_BLOCKS_PER_GROUP;
+	gdt_blocks = (groups_count + LAB5FS_DESC_PER_BLOCK - 1) / LAB5FS_DESC_PER_BLOCK;
+	if (num_blocks < LAB5FS_GDT_FIRST_NUM + gdt_blocks + LAB5FS_ITABLE_BLOCKS + 16) {
+		printf("'%s' is too small for a lab5fs file-system\n", dev_path);
+		exit(1);
+	}
+
+	/* the journal takes up to a quarter of group 0's free space */
+	journal_blocks = (group_blocks(0, num_blocks) - group_used_blocks(0)) / 4;
+	if (journal_blocks > LAB5FS_JOURNAL_BLOCKS)
+		journal_blocks = LAB5FS_JOURNAL_BLOCKS;
+	if (journal_blocks < LAB5FS_JOURNAL_MIN_BLOCKS)
+		journal_blocks = 0;
+	free_blocks = count_free_blocks(num_blocks);
 
 	/* create the file system. */
 	if (!mklab5fs(dev_path, num_blocks, free_blocks))